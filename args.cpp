@@ -1,21 +1,208 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <charconv>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <span>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <variant>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Splits an argument list on whitespace without copying it. Tokens are views
+// into the caller's buffer, which must outlive the Tokenizer.
+//
+// A Tokenizer built from an argv-style span yields each element as one token
+// as is, so values may contain whitespace.
+class Tokenizer {
+ public:
+  constexpr explicit Tokenizer(std::string_view input) : input_(input) {}
+  constexpr explicit Tokenizer(std::span<const char* const> args)
+      : args_(args) {}
+  // Yields the tokens of `input` found by a StructuralIndex, given as
+  // alternating start and end offsets.
+  constexpr Tokenizer(std::string_view input,
+                      std::span<const uint32_t> boundaries)
+      : input_(input), boundaries_(boundaries) {}
+
+  // Stores the next token in `token`. Returns false once the input is
+  // exhausted.
+  constexpr bool next(std::string_view& token) {
+    if (args_.data() != nullptr) {
+      if (cursor_ == args_.size()) {
+        exhausted_ = true;
+        return false;
+      }
+      token = args_[cursor_++];
+      return true;
+    }
+    if (boundaries_.data() != nullptr) {
+      if (cursor_ == boundaries_.size()) {
+        exhausted_ = true;
+        return false;
+      }
+      token = input_.substr(boundaries_[cursor_],
+                            boundaries_[cursor_ + 1] - boundaries_[cursor_]);
+      cursor_ += 2;
+      return true;
+    }
+    while (cursor_ < input_.size() && isSpace(input_[cursor_])) {
+      ++cursor_;
+    }
+    if (cursor_ == input_.size()) {
+      exhausted_ = true;
+      return false;
+    }
+    size_t start = cursor_;
+    while (cursor_ < input_.size() && !isSpace(input_[cursor_])) {
+      ++cursor_;
+    }
+    token = input_.substr(start, cursor_ - start);
+    return true;
+  }
+
+  // Whether next() has been called past the last token.
+  constexpr bool exhausted() const { return exhausted_; }
+
+  // Same set as std::isspace in the "C" locale, which is what operator>> used.
+  static constexpr bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+           c == '\r';
+  }
+
+ private:
+  std::string_view input_;
+  std::span<const char* const> args_;
+  std::span<const uint32_t> boundaries_;
+  size_t cursor_ = 0;
+  bool exhausted_ = false;
+};
+
+// Returns a mask with bit i set if block[i] is whitespace, one byte at a time.
+inline uint64_t whitespace_mask_scalar(const char* block) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; ++i) {
+    unsigned char c = block[i];
+    if (c == ' ' || (c >= '\t' && c <= '\r')) {
+      mask |= uint64_t{1} << i;
+    }
+  }
+  return mask;
+}
+
+// Returns a mask with bit i set if block[i] is whitespace, 16 bytes at a time
+// where SSE2 is available.
+inline uint64_t whitespace_mask(const char* block) {
+#ifdef __SSE2__
+  uint64_t mask = 0;
+  for (int i = 0; i < 4; ++i) {
+    __m128i bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * i));
+    // '\t'..'\r' are the bytes that land in 0..4 once 9 is subtracted.
+    __m128i shifted = _mm_sub_epi8(bytes, _mm_set1_epi8(9));
+    __m128i control =
+        _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted);
+    __m128i space = _mm_cmpeq_epi8(bytes, _mm_set1_epi8(' '));
+    uint64_t bits = static_cast<uint16_t>(
+        _mm_movemask_epi8(_mm_or_si128(control, space)));
+    mask |= bits << (16 * i);
+  }
+  return mask;
+#else
+  return whitespace_mask_scalar(block);
+#endif
+}
+
+// Finds the token boundaries of a whole argument list up front, 64 bytes at
+// a time, in the manner of simdjson's first stage. Tokenizing long inputs from
+// the index avoids testing every byte on the way to the next token.
+class StructuralIndex {
+ public:
+  // Boundaries are 32-bit offsets, so longer inputs cannot be indexed.
+  static constexpr size_t kMaxInputSize = UINT32_MAX;
+
+  // Indexes `input`, reusing the storage from previous calls. Returns false,
+  // leaving the index empty, if `input` is longer than kMaxInputSize.
+  bool build(std::string_view input) {
+    boundaries_.clear();
+    if (input.size() > kMaxInputSize) {
+      return false;
+    }
+    // Whether the byte just before the current block is part of a token.
+    uint64_t in_token = 0;
+    char tail[64];
+    for (size_t offset = 0; offset < input.size(); offset += 64) {
+      const char* block = input.data() + offset;
+      size_t size = std::min<size_t>(64, input.size() - offset);
+      if (size < 64) {
+        std::memset(tail, ' ', sizeof(tail));
+        std::memcpy(tail, block, size);
+        block = tail;
+      }
+      uint64_t token = ~whitespace_mask(block);
+      uint64_t previous = (token << 1) | in_token;
+      // A token starts or ends wherever a byte differs from the one before.
+      // Starts and ends alternate, so walking them in bit order yields the
+      // offsets in the order the Tokenizer wants them.
+      uint64_t edges = token ^ previous;
+      while (edges != 0) {
+        boundaries_.push_back(offset + std::countr_zero(edges));
+        edges &= edges - 1;
+      }
+      in_token = token >> 63;
+    }
+    if (boundaries_.size() % 2 != 0) {
+      boundaries_.push_back(input.size());
+    }
+    return true;
+  }
+
+  std::span<const uint32_t> boundaries() const { return boundaries_; }
+
+ private:
+  std::vector<uint32_t> boundaries_;
+};
 
 class AbstractFlag {
  public:
   virtual ~AbstractFlag() = default;
-  virtual bool setValue(std::stringstream&) = 0;
+  virtual bool setValue(Tokenizer&) = 0;
 };
 
-class BoolFlag : public AbstractFlag {
+class BoolFlag final : public AbstractFlag {
  public:
   bool getValue() { return value_; }
-  bool setValue(std::stringstream&) override {
+  bool setValue(Tokenizer&) override {
     value_ = true;
     return true;
   }
@@ -24,164 +211,4965 @@ class BoolFlag : public AbstractFlag {
   bool value_ = false;
 };
 
-class Int32Flag : public AbstractFlag {
+// Converts eight ASCII digits, first digit in the lowest byte, to their value.
+// Returns false if any of the bytes is not a digit.
+inline bool parse_eight_digits(const char* digits, uint32_t& value) {
+  uint64_t chunk;
+  std::memcpy(&chunk, digits, sizeof(chunk));
+  // Every byte must be in 0x30..0x39: the high nibble is 3 and adding 6 does
+  // not carry into it.
+  if ((chunk & 0xf0f0f0f0f0f0f0f0ull) != 0x3030303030303030ull ||
+      ((chunk + 0x0606060606060606ull) & 0xf0f0f0f0f0f0f0f0ull) !=
+          0x3030303030303030ull) {
+    return false;
+  }
+  chunk -= 0x3030303030303030ull;
+  chunk = (chunk * 10) + (chunk >> 8);
+  uint64_t low = (chunk & 0x000000ff000000ffull) * (100 + (1000000ull << 32));
+  uint64_t high =
+      ((chunk >> 16) & 0x000000ff000000ffull) * (1 + (10000ull << 32));
+  chunk = (low + high) >> 32;
+  value = static_cast<uint32_t>(chunk);
+  return true;
+}
+
+// The digit-at-a-time path of parse_int32 for constant evaluation, where
+// neither memcpy nor from_chars is available.
+constexpr bool parse_int32_digits(std::string_view digits, bool negative,
+                                  int32_t& value) {
+  if (digits.empty()) {
+    return false;
+  }
+  uint64_t magnitude = 0;
+  for (char c : digits) {
+    unsigned digit = static_cast<unsigned char>(c) - '0';
+    if (digit > 9) {
+      return false;
+    }
+    magnitude = magnitude * 10 + digit;
+    if (magnitude > 2147483648ull) {
+      return false;
+    }
+  }
+  if (magnitude > (negative ? 2147483648ull : 2147483647ull)) {
+    return false;
+  }
+  value = static_cast<int32_t>(negative ? -static_cast<int64_t>(magnitude)
+                                        : static_cast<int64_t>(magnitude));
+  return true;
+}
+
+// Parses a whole token as a base-10 int32_t, with an optional leading sign.
+// Unlike operator>>, it does not consult the locale and fails on out of range
+// values instead of clamping them.
+constexpr bool parse_int32(std::string_view token, int32_t& value) {
+  bool negative = false;
+  if (token.size() > 1 && (token[0] == '-' || token[0] == '+')) {
+    negative = token[0] == '-';
+    token.remove_prefix(1);
+  }
+  if (std::is_constant_evaluated()) {
+    return parse_int32_digits(token, negative, value);
+  }
+  // Ten digits cannot overflow the accumulator; longer tokens may still be in
+  // range thanks to leading zeros, so they take the slow path.
+  if (token.empty() || token.size() > 10 ||
+      std::endian::native != std::endian::little) {
+    const char* begin = token.data();
+    const char* end = begin + token.size();
+    int64_t wide;
+    auto [ptr, ec] = std::from_chars(begin, end, wide);
+    if (ec != std::errc() || ptr != end || wide < 0) {
+      return false;
+    }
+    if (negative ? -wide < INT32_MIN : wide > INT32_MAX) {
+      return false;
+    }
+    value = static_cast<int32_t>(negative ? -wide : wide);
+    return true;
+  }
+
+  // The last eight digits, right-aligned in a block padded with '0', always
+  // go through parse_eight_digits; at most two digits precede them.
+  uint64_t magnitude = 0;
+  if (token.size() > 8) {
+    size_t head = token.size() - 8;
+    for (size_t i = 0; i < head; ++i) {
+      unsigned digit = static_cast<unsigned char>(token[i]) - '0';
+      if (digit > 9) {
+        return false;
+      }
+      magnitude = magnitude * 10 + digit;
+    }
+    token.remove_prefix(head);
+  }
+  char block[8] = {'0', '0', '0', '0', '0', '0', '0', '0'};
+  std::memcpy(block + 8 - token.size(), token.data(), token.size());
+  uint32_t low;
+  if (!parse_eight_digits(block, low)) {
+    return false;
+  }
+  magnitude = magnitude * 100000000 + low;
+  if (magnitude > (negative ? 2147483648ull : 2147483647ull)) {
+    return false;
+  }
+  value = static_cast<int32_t>(negative ? -static_cast<int64_t>(magnitude)
+                                        : static_cast<int64_t>(magnitude));
+  return true;
+}
+
+class Int32Flag final : public AbstractFlag {
  public:
+  Int32Flag() = default;
+  explicit Int32Flag(int32_t default_value) : value_(default_value) {}
   int32_t getValue() { return value_; }
-  bool setValue(std::stringstream& tokens) override {
-    tokens >> value_;
-    return !tokens.fail();
+  bool setValue(Tokenizer& tokens) override {
+    std::string_view token;
+    if (!tokens.next(token)) {
+      return false;
+    }
+    return parse_int32(token, value_);
   }
 
  private:
   int32_t value_ = 0;
 };
 
-class StringFlag : public AbstractFlag {
+// Keeps its storage across parses, so once it has held a value of a given
+// length, setting values up to that length does not allocate.
+class StringFlag final : public AbstractFlag {
  public:
-  std::string getValue() { return value_; }
-  bool setValue(std::stringstream& tokens) override {
-    tokens >> value_;
-    return !tokens.fail();
+  StringFlag() = default;
+  explicit StringFlag(std::string_view default_value) : value_(default_value) {}
+  const std::string& getValue() const { return value_; }
+  // Makes room for values of up to `size` bytes ahead of the first parse.
+  void reserve(size_t size) { value_.reserve(size); }
+  bool setValue(Tokenizer& tokens) override {
+    std::string_view token;
+    if (!tokens.next(token)) {
+      return false;
+    }
+    value_.assign(token);
+    return true;
   }
 
  private:
   std::string value_ = "";
 };
 
-using FlagName = std::string;
-using FlagRegistry = std::unordered_map<FlagName, AbstractFlag*>;
+// Borrows its value from the parsed input instead of copying it, so the input
+// (argv, a request buffer, ...) must outlive every read of the value.
+class StringViewFlag final : public AbstractFlag {
+ public:
+  std::string_view getValue() const { return value_; }
+  bool setValue(Tokenizer& tokens) override { return tokens.next(value_); }
 
-enum State { DONE, PARSE_ERROR, READ_FLAG };
-State read_flag(const FlagRegistry& registry, std::stringstream& tokens) {
-  std::string name_token;
-  tokens >> name_token;
-  if (tokens.fail()) {
-    return DONE;
+ private:
+  std::string_view value_;
+};
+
+// Atomic flags may be read on any thread while a re-parse sets them. Reads are
+// relaxed loads, plain moves on x86, and sets publish with release semantics.
+// Each takes a cache line of its own, so that a frequently set flag does not
+// slow down reads of its neighbours.
+//
+// Parsing only ever sets a bool flag, so a re-parse that omits it leaves it
+// true; reset() clears it before the re-parse.
+class alignas(64) AtomicBoolFlag final : public AbstractFlag {
+ public:
+  bool getValue() const { return value_.load(std::memory_order_relaxed); }
+  bool setValue(Tokenizer&) override {
+    value_.store(true, std::memory_order_release);
+    return true;
   }
-  if (name_token.size() <= 1) {
-    return PARSE_ERROR;
+  void reset() { value_.store(false, std::memory_order_release); }
+
+ private:
+  std::atomic<bool> value_{false};
+};
+
+class alignas(64) AtomicInt32Flag final : public AbstractFlag {
+ public:
+  int32_t getValue() const { return value_.load(std::memory_order_relaxed); }
+  // Leaves the value unchanged when the token is not a valid int32.
+  bool setValue(Tokenizer& tokens) override {
+    std::string_view token;
+    int32_t value = 0;
+    if (!tokens.next(token) || !parse_int32(token, value)) {
+      return false;
+    }
+    value_.store(value, std::memory_order_release);
+    return true;
   }
-  if (name_token.at(0) != '-') {
-    return PARSE_ERROR;
+
+ private:
+  std::atomic<int32_t> value_{0};
+};
+
+// Lets FlagRegistry be searched by string_view without building a FlagName.
+struct FlagNameHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view name) const {
+    return std::hash<std::string_view>()(name);
   }
-  std::string name = name_token.substr(1);
+};
+
+using FlagName = std::string;
+using FlagRegistry =
+    std::unordered_map<FlagName, AbstractFlag*, FlagNameHash, std::equal_to<>>;
+
+AbstractFlag* find_flag(const FlagRegistry& registry, std::string_view name) {
   auto registry_it = registry.find(name);
   if (registry_it == registry.end()) {
-    return PARSE_ERROR;
+    return nullptr;
   }
-  AbstractFlag* flag = registry_it->second;
-  bool success = flag->setValue(tokens);
-  if (!success) {
-    return PARSE_ERROR;
+  return registry_it->second;
+}
+
+// FNV-1a over the name followed by the splitmix64 finalizer.
+constexpr uint64_t hash_name(std::string_view name) {
+  uint64_t h = 14695981039346656037ull;
+  for (char c : name) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 1099511628211ull;
   }
-  return READ_FLAG;
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
 }
 
-bool parse_arg_list(const FlagRegistry& registry, const std::string& arg_list) {
-  std::stringstream tokens(arg_list);
-  State state = READ_FLAG;
+// Remixes a name's hash with its bucket's displacement in a perfect hash.
+constexpr uint64_t displace_hash(uint64_t h, uint64_t displacement) {
+  h += displacement * 0x9e3779b97f4a7c15ull;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  return h ^ (h >> 33);
+}
 
-  while (state == READ_FLAG) {
-    state = read_flag(registry, tokens);
+// Perfect hash over a set of flag names fixed at build time, using the
+// hash-and-displace scheme: names are grouped into buckets by hash, and each
+// bucket gets a displacement that sends all of its names to free slots.
+// Looking a name up hashes it once and compares against a single slot.
+// Duplicate names have no such displacement, so they fail to compile when the
+// hash is built at compile time and abort the program otherwise.
+template <size_t N>
+class PerfectHash {
+ public:
+  static constexpr size_t kSlots = std::bit_ceil(N + 1);
+  static constexpr size_t kBuckets = N / 2 + 1;
+
+  constexpr explicit PerfectHash(const std::array<std::string_view, N>& names) {
+    std::array<uint64_t, N> hashes{};
+    std::array<size_t, kBuckets> bucket_sizes{};
+    std::array<size_t, N> order{};
+    for (size_t i = 0; i < N; ++i) {
+      hashes[i] = hash_name(names[i]);
+      ++bucket_sizes[bucket(hashes[i])];
+      order[i] = i;
+    }
+    // Place the largest buckets first, while most slots are still free.
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      size_t bucket_a = bucket(hashes[a]);
+      size_t bucket_b = bucket(hashes[b]);
+      if (bucket_sizes[bucket_a] != bucket_sizes[bucket_b]) {
+        return bucket_sizes[bucket_a] > bucket_sizes[bucket_b];
+      }
+      return bucket_a < bucket_b;
+    });
+
+    std::array<bool, kSlots> taken{};
+    for (size_t begin = 0; begin < N;) {
+      size_t b = bucket(hashes[order[begin]]);
+      size_t end = begin;
+      while (end < N && bucket(hashes[order[end]]) == b) {
+        for (size_t i = begin; i < end; ++i) {
+          if (names[order[i]] == names[order[end]]) {
+            std::abort();
+          }
+        }
+        ++end;
+      }
+      uint64_t displacement = 0;
+      while (!fits(hashes, order, begin, end, displacement, taken)) {
+        ++displacement;
+      }
+      displacements_[b] = displacement;
+      for (size_t i = begin; i < end; ++i) {
+        size_t s = slot(hashes[order[i]], displacement);
+        taken[s] = true;
+        slots_[s] = {names[order[i]], order[i]};
+      }
+      begin = end;
+    }
   }
-  return state == DONE;
-}
 
-void test_happy() {
-  BoolFlag local;
-  Int32Flag port;
-  StringFlag directory;
-  FlagRegistry registry;
-  registry["l"] = &local;
-  registry["p"] = &port;
-  registry["d"] = &directory;
-  std::string arg_list = "-l -p 1080 -d /hola/mundo";
+  // Returns the position of `name` in the list given to the constructor, or N
+  // if it is not one of them.
+  constexpr size_t find(std::string_view name) const {
+    uint64_t h = hash_name(name);
+    const Slot& candidate = slots_[slot(h, displacements_[bucket(h)])];
+    if (candidate.index == N || candidate.name != name) {
+      return N;
+    }
+    return candidate.index;
+  }
 
-  bool success = parse_arg_list(registry, arg_list);
+ private:
+  struct Slot {
+    std::string_view name;
+    size_t index = N;
+  };
 
-  assert(success);
-  assert(local.getValue() == true);
-  assert(port.getValue() == 1080);
-  assert(directory.getValue() == "/hola/mundo");
-}
+  static constexpr size_t bucket(uint64_t h) { return (h >> 32) % kBuckets; }
 
-void test_not_in_arg_list() {
-  BoolFlag local;
-  Int32Flag port;
-  StringFlag directory;
-  FlagRegistry registry;
-  registry["l"] = &local;
-  registry["p"] = &port;
-  registry["d"] = &directory;
-  std::string arg_list = "";
+  static constexpr size_t slot(uint64_t h, uint64_t displacement) {
+    return displace_hash(h, displacement) & (kSlots - 1);
+  }
 
-  bool success = parse_arg_list(registry, arg_list);
+  // Whether displacement sends the names order[begin, end) to distinct free
+  // slots.
+  static constexpr bool fits(const std::array<uint64_t, N>& hashes,
+                             const std::array<size_t, N>& order, size_t begin,
+                             size_t end, uint64_t displacement,
+                             const std::array<bool, kSlots>& taken) {
+    for (size_t i = begin; i < end; ++i) {
+      size_t s = slot(hashes[order[i]], displacement);
+      if (taken[s]) {
+        return false;
+      }
+      for (size_t j = begin; j < i; ++j) {
+        if (slot(hashes[order[j]], displacement) == s) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
 
-  assert(success);
-  assert(local.getValue() == false);
-  assert(port.getValue() == 0);
-  assert(directory.getValue() == "");
+  std::array<uint64_t, kBuckets> displacements_{};
+  std::array<Slot, kSlots> slots_{};
+};
+
+// Registry for flag sets known at build time. `names` is usually a constexpr
+// PerfectHash, and flags[i] is the flag registered under the i-th name.
+template <size_t N>
+struct StaticFlagRegistry {
+  const PerfectHash<N>& names;
+  std::array<AbstractFlag*, N> flags;
+};
+
+template <size_t N>
+AbstractFlag* find_flag(const StaticFlagRegistry<N>& registry,
+                        std::string_view name) {
+  size_t index = registry.names.find(name);
+  if (index == N) {
+    return nullptr;
+  }
+  return registry.flags[index];
 }
 
-void test_not_in_scheme() {
-  FlagRegistry registry;
-  std::string arg_list = "-x";
+// Maps names to dense slot numbers without per-name or per-node allocations:
+// names are interned back to back in one arena, and an open-addressed index
+// of 16-byte entries, four to a cache line, points into it.
+class FlatNameIndex {
+ public:
+  static constexpr size_t kNotFound = SIZE_MAX;
 
-  bool success = parse_arg_list(registry, arg_list);
+  // Returns the slot of `name`, giving it the next free slot if it is new.
+  size_t insert(std::string_view name) {
+    if ((size_ + 1) * 4 > capacity() * 3) {
+      grow();
+    }
+    uint64_t h = hash_name(name);
+    Entry& entry = this->entry(probe(h, name));
+    if (entry.slot != kEmpty) {
+      return entry.slot;
+    }
+    entry = {static_cast<uint32_t>(h >> 32),
+             static_cast<uint32_t>(names_.size()),
+             static_cast<uint32_t>(name.size()), static_cast<uint32_t>(size_)};
+    names_.append(name);
+    return size_++;
+  }
 
-  assert(!success);
-}
+  // Returns the slot of `name`, or kNotFound.
+  size_t find(std::string_view name) const {
+    if (size_ == 0) {
+      return kNotFound;
+    }
+    const Entry& entry = this->entry(probe(hash_name(name), name));
+    if (entry.slot == kEmpty) {
+      return kNotFound;
+    }
+    return entry.slot;
+  }
 
-void test_value_starts_with_hyphen() {
-  Int32Flag port;
-  StringFlag directory;
-  FlagRegistry registry;
-  registry["p"] = &port;
-  registry["d"] = &directory;
-  std::string arg_list = "-p -1080 -d -hola_mundo";
+  size_t size() const { return size_; }
 
-  bool success = parse_arg_list(registry, arg_list);
+ private:
+  static constexpr uint32_t kEmpty = UINT32_MAX;
 
-  assert(success);
-  assert(port.getValue() == -1080);
-  assert(directory.getValue() == "-hola_mundo");
-}
+  struct Entry {
+    uint32_t hash;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t slot = kEmpty;
+  };
+  static constexpr size_t kEntriesPerLine = 4;
+  struct alignas(64) Line {
+    Entry entries[kEntriesPerLine];
+  };
 
-void test_early_exit() {
-  StringFlag directory;
-  FlagRegistry registry;
-  registry["d"] = &directory;
-  std::string arg_list = "-d";
+  size_t capacity() const { return lines_.size() * kEntriesPerLine; }
 
-  bool success = parse_arg_list(registry, arg_list);
+  Entry& entry(size_t i) {
+    return lines_[i / kEntriesPerLine].entries[i % kEntriesPerLine];
+  }
+  const Entry& entry(size_t i) const {
+    return lines_[i / kEntriesPerLine].entries[i % kEntriesPerLine];
+  }
 
-  assert(!success);
+  // Returns the index of the entry holding `name`, or of the empty entry where
+  // it belongs.
+  size_t probe(uint64_t h, std::string_view name) const {
+    uint32_t short_hash = h >> 32;
+    size_t mask = capacity() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+      const Entry& e = entry(i);
+      if (e.slot == kEmpty) {
+        return i;
+      }
+      if (e.hash == short_hash && e.length == name.size() &&
+          std::memcmp(names_.data() + e.offset, name.data(), name.size()) ==
+              0) {
+        return i;
+      }
+    }
+  }
+
+  void grow() {
+    std::vector<Line> old_lines(std::max<size_t>(lines_.size() * 2, 1));
+    old_lines.swap(lines_);
+    for (const Line& line : old_lines) {
+      for (const Entry& e : line.entries) {
+        if (e.slot == kEmpty) {
+          continue;
+        }
+        std::string_view name(names_.data() + e.offset, e.length);
+        entry(probe(hash_name(name), name)) = e;
+      }
+    }
+  }
+
+  std::string names_;
+  std::vector<Line> lines_;
+  size_t size_ = 0;
+};
+
+// Registry for flag sets built at runtime, backed by a FlatNameIndex.
+class FlatFlagRegistry {
+ public:
+  // Registers `flag` under `name`, replacing any flag already there.
+  void add(std::string_view name, AbstractFlag* flag) {
+    size_t slot = names_.insert(name);
+    if (slot == flags_.size()) {
+      flags_.push_back(flag);
+    } else {
+      flags_[slot] = flag;
+    }
+  }
+
+  AbstractFlag* find(std::string_view name) const {
+    size_t slot = names_.find(name);
+    if (slot == FlatNameIndex::kNotFound) {
+      return nullptr;
+    }
+    return flags_[slot];
+  }
+
+  size_t size() const { return flags_.size(); }
+
+ private:
+  FlatNameIndex names_;
+  std::vector<AbstractFlag*> flags_;
+};
+
+AbstractFlag* find_flag(const FlatFlagRegistry& registry,
+                        std::string_view name) {
+  return registry.find(name);
 }
 
-void test_bad_int() {
-  Int32Flag port;
-  FlagRegistry registry;
-  registry["p"] = &port;
-  std::string arg_list = "-p abc";
+// A flag stored by value. The built-in kinds are final, so setting them
+// through std::visit needs no virtual call; other AbstractFlag implementations
+// are still accepted by pointer.
+using FlagValue = std::variant<BoolFlag, Int32Flag, StringFlag,
+                               StringViewFlag, AbstractFlag*>;
 
-  bool success = parse_arg_list(registry, arg_list);
+bool set_flag_value(AbstractFlag& flag, Tokenizer& tokens) {
+  return flag.setValue(tokens);
+}
 
-  assert(!success);
+bool set_flag_value(FlagValue& flag, Tokenizer& tokens) {
+  return std::visit(
+      [&](auto& value) {
+        if constexpr (std::is_same_v<decltype(value), AbstractFlag*&>) {
+          return value->setValue(tokens);
+        } else {
+          return value.setValue(tokens);
+        }
+      },
+      flag);
 }
 
-void test_duplicate() {
-  Int32Flag port;
-  FlagRegistry registry;
-  registry["p"] = &port;
-  std::string arg_list = "-p 1080 -p 88";
+// Flags owned as FlagValues in one contiguous vector. Flags are addressed by
+// the slot returned from add(), since adding more flags may move them.
+class VariantFlags {
+ public:
+  // Registers `flag` under `name`, replacing any flag already there, and
+  // returns its slot.
+  size_t add(std::string_view name, FlagValue flag) {
+    size_t slot = names_.insert(name);
+    if (slot == flags_.size()) {
+      flags_.push_back(std::move(flag));
+    } else {
+      flags_[slot] = std::move(flag);
+    }
+    return slot;
+  }
 
-  bool success = parse_arg_list(registry, arg_list);
+  template <typename Flag>
+  Flag& get(size_t slot) {
+    return std::get<Flag>(flags_[slot]);
+  }
 
-  assert(success);
-  assert(port.getValue() == 88);
+  FlagValue* find(std::string_view name) {
+    size_t slot = names_.find(name);
+    if (slot == FlatNameIndex::kNotFound) {
+      return nullptr;
+    }
+    return &flags_[slot];
+  }
+
+ private:
+  FlatNameIndex names_;
+  std::vector<FlagValue> flags_;
+};
+
+// Parse target that sets the flags owned by `flags`.
+struct VariantFlagRegistry {
+  VariantFlags& flags;
+};
+
+FlagValue* find_flag(const VariantFlagRegistry& registry,
+                     std::string_view name) {
+  return registry.flags.find(name);
 }
 
-int main() {
+enum FlagKind { BOOL_FLAG, INT32_FLAG, STRING_FLAG };
+
+// Where a flag's value lives in a FlagValues block: the kind selects the
+// array and `index` the position in it.
+struct FlagSlot {
+  FlagKind kind;
+  uint32_t index;
+};
+
+class FlagSchema;
+class LazyFlagValues;
+
+// Bump allocator for string data. Memory is handed out from a list of chunks
+// that is only ever grown; reset() makes all of it reusable at once, which
+// invalidates every view copy() returned.
+class StringArena {
+ public:
+  static constexpr size_t kChunkSize = 4096;
+
+  StringArena() = default;
+  StringArena(const StringArena&) = delete;
+  StringArena& operator=(const StringArena&) = delete;
+  StringArena(StringArena&&) = default;
+  StringArena& operator=(StringArena&&) = default;
+
+  std::string_view copy(std::string_view text) {
+    if (text.empty()) {
+      return {};
+    }
+    while (chunk_ == chunks_.size() ||
+           chunks_[chunk_].size - used_ < text.size()) {
+      nextChunk(text.size());
+    }
+    char* data = chunks_[chunk_].data.get() + used_;
+    std::memcpy(data, text.data(), text.size());
+    used_ += text.size();
+    return {data, text.size()};
+  }
+
+  void reset() {
+    chunk_ = 0;
+    used_ = 0;
+  }
+
+  // Whether `data` points into memory handed out by this arena.
+  bool owns(const char* data) const {
+    for (const Chunk& chunk : chunks_) {
+      if (std::less_equal<>()(chunk.data.get(), data) &&
+          std::less<>()(data, chunk.data.get() + chunk.size)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  // Moves on to the next chunk, allocating one at the end of the list if
+  // there is none left.
+  void nextChunk(size_t size) {
+    if (chunk_ < chunks_.size()) {
+      ++chunk_;
+      used_ = 0;
+    }
+    if (chunk_ == chunks_.size()) {
+      size = std::max(size, kChunkSize);
+      chunks_.push_back({std::make_unique<char[]>(size), size});
+    }
+  }
+
+  std::vector<Chunk> chunks_;
+  size_t chunk_ = 0;
+  size_t used_ = 0;
+};
+
+// Values for every flag of a FlagSchema, laid out as one array per kind.
+// String values are copied into an arena owned by the block. Setting a string
+// flag again reuses its bytes when the new value fits; other arena memory is
+// only reclaimed when the block is reset to its schema's defaults. Copying a
+// block, or assigning one to another of the same schema, reuses the
+// destination's storage.
+class FlagValues {
+ public:
+  FlagValues() = default;
+  FlagValues(const FlagValues& other)
+      : bools_(other.bools_),
+        int32s_(other.int32s_),
+        strings_(other.strings_),
+        string_capacities_(strings_.size()),
+        borrow_strings_(other.borrow_strings_) {
+    copyStrings(other);
+  }
+  FlagValues& operator=(const FlagValues& other) {
+    if (this != &other) {
+      bools_ = other.bools_;
+      int32s_ = other.int32s_;
+      strings_ = other.strings_;
+      string_capacities_.assign(strings_.size(), 0);
+      arena_.reset();
+      copyStrings(other);
+    }
+    return *this;
+  }
+  FlagValues(FlagValues&&) = default;
+  FlagValues& operator=(FlagValues&&) = default;
+
+  bool getBool(size_t index) const { return bools_[index]; }
+  int32_t getInt32(size_t index) const { return int32s_[index]; }
+  // The number of flags of kind `kind`.
+  size_t size(FlagKind kind) const {
+    return kind == BOOL_FLAG    ? bools_.size()
+           : kind == INT32_FLAG ? int32s_.size()
+                                : strings_.size();
+  }
+  // The view stays valid until the flag is set again, or the block is reset,
+  // assigned to or destroyed.
+  std::string_view getString(size_t index) const { return strings_[index]; }
+
+  bool setValue(FlagSlot slot, Tokenizer& tokens) {
+    if (slot.kind == BOOL_FLAG) {
+      bools_[slot.index] = true;
+      return true;
+    }
+    std::string_view token;
+    if (!tokens.next(token)) {
+      return false;
+    }
+    if (slot.kind == INT32_FLAG) {
+      return setInt32(slot.index, token);
+    }
+    setString(slot.index, token);
+    return true;
+  }
+
+  bool setInt32(size_t index, std::string_view token) {
+    return parse_int32(token, int32s_[index]);
+  }
+  void setString(size_t index, std::string_view token) {
+    size_t& capacity = string_capacities_[index];
+    if (borrow_strings_) {
+      strings_[index] = token;
+      capacity = 0;
+    } else if (token.size() <= capacity) {
+      char* data = const_cast<char*>(strings_[index].data());
+      std::memcpy(data, token.data(), token.size());
+      strings_[index] = {data, token.size()};
+    } else {
+      strings_[index] = arena_.copy(token);
+      capacity = token.size();
+    }
+  }
+
+  // When set, string values are views into the parsed input rather than
+  // copies, so the input must outlive the block's reads of them.
+  void borrowStrings(bool borrow) { borrow_strings_ = borrow; }
+  bool borrowsStrings() const { return borrow_strings_; }
+
+ private:
+  friend class FlagSchema;
+  friend class LazyFlagValues;
+
+  // Copies into this block's arena the strings that live in `other`'s. The
+  // rest are schema defaults, which outlive both blocks.
+  void copyStrings(const FlagValues& other) {
+    for (size_t i = 0; i < strings_.size(); ++i) {
+      if (other.arena_.owns(strings_[i].data())) {
+        strings_[i] = arena_.copy(strings_[i]);
+        string_capacities_[i] = strings_[i].size();
+      }
+    }
+  }
+
+  std::vector<uint8_t> bools_;
+  std::vector<int32_t> int32s_;
+  std::vector<std::string_view> strings_;
+  // The arena bytes each string value may be overwritten in place with.
+  std::vector<size_t> string_capacities_;
+  StringArena arena_;
+  bool borrow_strings_ = false;
+};
+
+// The names, kinds and defaults of a set of flags, without their values. A
+// schema is not modified by parsing, so any number of threads may parse
+// against it at once, each into its own FlagValues. It must outlive the
+// FlagValues made from it.
+class FlagSchema {
+ public:
+  // Each add method returns the index to read the flag's value with from a
+  // FlagValues block. Names must be unique; adding one twice aborts the
+  // program.
+  size_t addBool(std::string_view name) {
+    return add(name, BOOL_FLAG, defaults_.bools_, false);
+  }
+  size_t addInt32(std::string_view name, int32_t default_value = 0) {
+    return add(name, INT32_FLAG, defaults_.int32s_, default_value);
+  }
+  size_t addString(std::string_view name, std::string_view default_value = "") {
+    return add(name, STRING_FLAG, defaults_.strings_,
+               default_strings_.copy(default_value));
+  }
+
+  const FlagSlot* find(std::string_view name) const {
+    size_t slot = names_.find(name);
+    if (slot == FlatNameIndex::kNotFound) {
+      return nullptr;
+    }
+    return &slots_[slot];
+  }
+
+  // Returns a block holding every flag's default value.
+  FlagValues makeValues() const { return defaults_; }
+  const FlagValues& defaults() const { return defaults_; }
+
+  // Puts every flag in `values` back to its default value, which rewinds its
+  // string arena.
+  void reset(FlagValues& values) const { values = defaults_; }
+
+  // Fingerprint of the names, kinds and defaults of the flags, in the order
+  // they were added.
+  uint64_t hash() const { return hash_; }
+
+ private:
+  template <typename T, typename V>
+  size_t add(std::string_view name, FlagKind kind, std::vector<T>& defaults,
+             V default_value) {
+    size_t slot = names_.insert(name);
+    if (slot != slots_.size()) {
+      std::abort();
+    }
+    slots_.push_back({kind, static_cast<uint32_t>(defaults.size())});
+    defaults.push_back(default_value);
+    fingerprint(hash_name(name));
+    fingerprint(kind);
+    if constexpr (std::is_same_v<V, std::string_view>) {
+      defaults_.string_capacities_.push_back(0);
+      fingerprint(hash_name(default_value));
+    } else {
+      fingerprint(static_cast<uint32_t>(default_value));
+    }
+    return defaults.size() - 1;
+  }
+
+  void fingerprint(uint64_t value) { hash_ = displace_hash(hash_, value + 1); }
+
+  FlatNameIndex names_;
+  std::vector<FlagSlot> slots_;
+  StringArena default_strings_;
+  FlagValues defaults_;
+  uint64_t hash_ = 0;
+};
+
+// Records the value token of each flag of a FlagSchema and converts it on
+// first read, caching the result. Parsing a line where only a few of many
+// flags are ever read then skips most conversions. Tokens are views into the
+// parsed input, which must outlive the reads. Reads are not thread-safe.
+class LazyFlagValues {
+ public:
+  explicit LazyFlagValues(const FlagSchema& schema);
+
+  // Puts every flag back to its default value in `schema`, reusing storage.
+  void reset(const FlagSchema& schema);
+
+  bool getBool(size_t index) const { return bools_[index]; }
+  // Returns nullopt if the value given for the flag is not a valid int32.
+  std::optional<int32_t> getInt32(size_t index) const {
+    if (int32_states_[index] == PENDING) {
+      bool valid = parse_int32(int32_tokens_[index], int32s_[index]);
+      int32_states_[index] = valid ? CONVERTED : INVALID;
+    }
+    if (int32_states_[index] == INVALID) {
+      return std::nullopt;
+    }
+    return int32s_[index];
+  }
+  std::string_view getString(size_t index) const { return strings_[index]; }
+
+  // Converts every value not read yet. Returns false if any is invalid.
+  bool validateAll() const {
+    bool valid = true;
+    for (size_t i = 0; i < int32_states_.size(); ++i) {
+      valid &= getInt32(i).has_value();
+    }
+    return valid;
+  }
+
+  bool setValue(FlagSlot slot, Tokenizer& tokens) {
+    if (slot.kind == BOOL_FLAG) {
+      bools_[slot.index] = true;
+      return true;
+    }
+    std::string_view token;
+    if (!tokens.next(token)) {
+      return false;
+    }
+    if (slot.kind == INT32_FLAG) {
+      int32_tokens_[slot.index] = token;
+      int32_states_[slot.index] = PENDING;
+    } else {
+      strings_[slot.index] = token;
+    }
+    return true;
+  }
+
+ private:
+  enum Conversion : uint8_t { CONVERTED, PENDING, INVALID };
+
+  std::vector<uint8_t> bools_;
+  std::vector<std::string_view> int32_tokens_;
+  mutable std::vector<Conversion> int32_states_;
+  mutable std::vector<int32_t> int32s_;
+  std::vector<std::string_view> strings_;
+};
+
+LazyFlagValues::LazyFlagValues(const FlagSchema& schema) { reset(schema); }
+
+void LazyFlagValues::reset(const FlagSchema& schema) {
+  const FlagValues& defaults = schema.defaults();
+  bools_ = defaults.bools_;
+  int32s_ = defaults.int32s_;
+  strings_ = defaults.strings_;
+  int32_tokens_.assign(int32s_.size(), {});
+  int32_states_.assign(int32s_.size(), CONVERTED);
+}
+
+// Parse target that writes the flags of `schema` into `values`, a FlagValues
+// or LazyFlagValues.
+template <typename Values>
+struct SchemaRegistry {
+  const FlagSchema& schema;
+  Values& values;
+};
+
+template <typename Values>
+struct FlagValueRef {
+  Values& values;
+  FlagSlot slot;
+};
+
+template <typename Values>
+std::optional<FlagValueRef<Values>> find_flag(
+    const SchemaRegistry<Values>& registry, std::string_view name) {
+  const FlagSlot* slot = registry.schema.find(name);
+  if (slot == nullptr) {
+    return std::nullopt;
+  }
+  return FlagValueRef<Values>{registry.values, *slot};
+}
+
+template <typename Values>
+bool set_flag_value(FlagValueRef<Values>& flag, Tokenizer& tokens) {
+  return flag.values.setValue(flag.slot, tokens);
+}
+
+enum State { DONE, PARSE_ERROR, READ_FLAG };
+
+// Sets the flag named by `name_token`, reading its value from `tokens`.
+template <typename Registry>
+constexpr State apply_flag(const Registry& registry,
+                           std::string_view name_token, Tokenizer& tokens) {
+  if (name_token.size() <= 1) {
+    return PARSE_ERROR;
+  }
+  if (name_token.at(0) != '-') {
+    return PARSE_ERROR;
+  }
+  auto flag = find_flag(registry, name_token.substr(1));
+  if (!flag) {
+    return PARSE_ERROR;
+  }
+  bool success = set_flag_value(*flag, tokens);
+  if (!success) {
+    return PARSE_ERROR;
+  }
+  return READ_FLAG;
+}
+
+template <typename Registry>
+constexpr State read_flag(const Registry& registry, Tokenizer& tokens) {
+  std::string_view name_token;
+  if (!tokens.next(name_token)) {
+    return DONE;
+  }
+  return apply_flag(registry, name_token, tokens);
+}
+
+template <typename Registry>
+constexpr bool parse_tokens(const Registry& registry, Tokenizer& tokens) {
+  State state = READ_FLAG;
+
+  while (state == READ_FLAG) {
+    state = read_flag(registry, tokens);
+  }
+  return state == DONE;
+}
+
+template <typename Registry>
+constexpr bool parse_arg_list(const Registry& registry,
+                              std::string_view arg_list) {
+  Tokenizer tokens(arg_list);
+  return parse_tokens(registry, tokens);
+}
+
+// Parses `arg_list` by way of `index`, which is rebuilt for it. Worthwhile for
+// inputs of many kilobytes. Inputs too long to index are tokenized directly.
+template <typename Registry>
+bool parse_indexed(const Registry& registry, std::string_view arg_list,
+                   StructuralIndex& index) {
+  if (!index.build(arg_list)) {
+    return parse_arg_list(registry, arg_list);
+  }
+  Tokenizer tokens(arg_list, index.boundaries());
+  return parse_tokens(registry, tokens);
+}
+
+// Parses into a FlagValues or LazyFlagValues laid out by `schema`. With lazy
+// values, invalid numbers are only reported when read or validated.
+template <typename Values>
+bool parse_arg_list(const FlagSchema& schema, std::string_view arg_list,
+                    Values& values) {
+  return parse_arg_list(SchemaRegistry<Values>{schema, values}, arg_list);
+}
+
+// A flag name usable as a template argument.
+template <size_t N>
+struct FlagLiteral {
+  constexpr FlagLiteral(const char (&name)[N]) { std::copy_n(name, N, chars); }
+  constexpr std::string_view view() const { return {chars, N - 1}; }
+
+  char chars[N];
+};
+
+// A flag of a FlagSet, holding a value of type T: bool, int32_t, std::string,
+// or std::string_view to borrow the value from the parsed input.
+template <FlagLiteral Name, typename T>
+struct Flag {
+  static_assert(std::is_same_v<T, bool> || std::is_same_v<T, int32_t> ||
+                    std::is_same_v<T, std::string> ||
+                    std::is_same_v<T, std::string_view>,
+                "unsupported flag type");
+  static constexpr std::string_view name = Name.view();
+
+  T value{};
+};
+
+constexpr bool set_typed_value(bool& value, Tokenizer&) {
+  value = true;
+  return true;
+}
+
+constexpr bool set_typed_value(int32_t& value, Tokenizer& tokens) {
+  std::string_view token;
+  return tokens.next(token) && parse_int32(token, value);
+}
+
+constexpr bool set_typed_value(std::string& value, Tokenizer& tokens) {
+  std::string_view token;
+  if (!tokens.next(token)) {
+    return false;
+  }
+  value.assign(token);
+  return true;
+}
+
+constexpr bool set_typed_value(std::string_view& value, Tokenizer& tokens) {
+  return tokens.next(value);
+}
+
+// A set of flags fixed at compile time, such as
+//
+//   using ServerFlags =
+//       FlagSet<Flag<"l", bool>, Flag<"p", int32_t>, Flag<"d", std::string>>;
+//
+// Its values live in the aggregate ServerFlags::Values and are read with
+// ServerFlags::get<"p">(values). Names are matched against constants known at
+// compile time, and each flag's conversion is inlined in the parser. Duplicate
+// names do not compile.
+template <typename... Flags>
+class FlagSet {
+ public:
+  static constexpr size_t kSize = sizeof...(Flags);
+  static constexpr size_t kMaxLinearSearch = 8;
+
+  struct Values : Flags... {};
+
+  static constexpr size_t indexOf(std::string_view name) {
+    constexpr std::array<std::string_view, kSize> names{Flags::name...};
+    return std::find(names.begin(), names.end(), name) - names.begin();
+  }
+
+  template <FlagLiteral Name>
+  static constexpr auto& get(Values& values) {
+    return static_cast<FlagAt<index<Name>()>&>(values).value;
+  }
+  template <FlagLiteral Name>
+  static constexpr const auto& get(const Values& values) {
+    return static_cast<const FlagAt<index<Name>()>&>(values).value;
+  }
+
+  // Returns the position of the flag named `name` in the list, or kSize if
+  // there is none. Small sets compare the name against each flag's in turn,
+  // which beats hashing it; larger ones go through the perfect hash.
+  static constexpr size_t find(std::string_view name) {
+    if constexpr (kSize <= kMaxLinearSearch) {
+      size_t index = 0;
+      ((name == Flags::name || (++index, false)) || ...);
+      return index;
+    } else {
+      return kNames.find(name);
+    }
+  }
+
+  // Sets the flag at `index` in the list, reading its value from `tokens`.
+  static constexpr bool setValue(Values& values, size_t index,
+                                 Tokenizer& tokens) {
+    return setValue(values, index, tokens, std::index_sequence_for<Flags...>());
+  }
+
+  static constexpr PerfectHash<kSize> kNames{
+      std::array<std::string_view, kSize>{Flags::name...}};
+
+ private:
+  template <size_t I>
+  using FlagAt = std::tuple_element_t<I, std::tuple<Flags...>>;
+
+  template <FlagLiteral Name>
+  static constexpr size_t index() {
+    constexpr size_t i = indexOf(Name.view());
+    static_assert(i < kSize, "no flag with this name");
+    return i;
+  }
+
+  static constexpr bool namesAreUnique() {
+    std::array<std::string_view, kSize> names{Flags::name...};
+    for (size_t i = 0; i < kSize; ++i) {
+      if (indexOf(names[i]) != i) {
+        return false;
+      }
+    }
+    return true;
+  }
+  static_assert(namesAreUnique(), "duplicate flag name");
+
+  template <size_t... I>
+  static constexpr bool setValue(Values& values, size_t index,
+                                 Tokenizer& tokens, std::index_sequence<I...>) {
+    bool success = false;
+    ((index == I &&
+      (success = set_typed_value(static_cast<FlagAt<I>&>(values).value,
+                                 tokens),
+       true)) ||
+     ...);
+    return success;
+  }
+};
+
+// Registry over the values of a FlagSet.
+template <typename Set>
+struct FlagSetRegistry {
+  typename Set::Values& values;
+};
+
+template <typename Set>
+struct FlagSetRef {
+  typename Set::Values& values;
+  size_t index;
+};
+
+template <typename Set>
+constexpr std::optional<FlagSetRef<Set>> find_flag(
+    const FlagSetRegistry<Set>& registry, std::string_view name) {
+  size_t index = Set::find(name);
+  if (index == Set::kSize) {
+    return std::nullopt;
+  }
+  return FlagSetRef<Set>{registry.values, index};
+}
+
+template <typename Set>
+constexpr bool set_flag_value(FlagSetRef<Set>& flag, Tokenizer& tokens) {
+  return Set::setValue(flag.values, flag.index, tokens);
+}
+
+// Parses into the values of the FlagSet `Set`.
+template <typename Set>
+constexpr bool parse_arg_list(std::string_view arg_list,
+                              typename Set::Values& values) {
+  return parse_arg_list(FlagSetRegistry<Set>{values}, arg_list);
+}
+
+// Not defined: reaching a call while evaluating parse_preset is what makes a
+// malformed preset fail to compile.
+void malformed_preset();
+
+// Parses the literal `Preset` into the values of the FlagSet `Set` at compile
+// time, so that
+//
+//   constexpr auto kServerPreset =
+//       parse_preset<PresetFlags, "-l -p 1080 -d /hola/mundo">();
+//
+// costs nothing at startup. String flags must be std::string_view, which then
+// point into the preset itself.
+template <typename Set, FlagLiteral Preset>
+consteval typename Set::Values parse_preset() {
+  typename Set::Values values{};
+  if (!parse_arg_list<Set>(Preset.view(), values)) {
+    malformed_preset();
+  }
+  return values;
+}
+
+// Value tokens collected by the first phase of parse_two_phase, kept between
+// parses so that their storage is reused.
+struct PendingValues {
+  std::vector<std::pair<uint32_t, std::string_view>> int32s;
+  std::vector<std::pair<uint32_t, std::string_view>> strings;
+};
+
+// Parses `arg_list` in two phases: the first resolves every flag name and
+// collects the value tokens by kind, and the second converts each kind in its
+// own loop. On long lines this trades the per-flag switch on the kind for
+// tight conversion loops. The result is that of parse_arg_list, but when it
+// fails, which of the flags before the error were set may differ.
+bool parse_two_phase(const FlagSchema& schema, std::string_view arg_list,
+                     FlagValues& values, PendingValues& pending) {
+  pending.int32s.clear();
+  pending.strings.clear();
+  Tokenizer tokens(arg_list);
+  std::string_view name_token;
+  while (tokens.next(name_token)) {
+    if (name_token.size() <= 1 || name_token[0] != '-') {
+      return false;
+    }
+    const FlagSlot* slot = schema.find(name_token.substr(1));
+    if (slot == nullptr) {
+      return false;
+    }
+    if (slot->kind == BOOL_FLAG) {
+      values.setValue(*slot, tokens);
+      continue;
+    }
+    std::string_view value;
+    if (!tokens.next(value)) {
+      return false;
+    }
+    auto& kind = slot->kind == INT32_FLAG ? pending.int32s : pending.strings;
+    kind.push_back({slot->index, value});
+  }
+
+  for (auto [index, token] : pending.int32s) {
+    if (!values.setInt32(index, token)) {
+      return false;
+    }
+  }
+  for (auto [index, token] : pending.strings) {
+    values.setString(index, token);
+  }
+  return true;
+}
+
+// Parses pre-split arguments. Unlike the argc/argv overload, `args` must not
+// include the program name.
+template <typename Registry>
+bool parse_argv(const Registry& registry, std::span<const char* const> args) {
+  Tokenizer tokens(args);
+  return parse_tokens(registry, tokens);
+}
+
+// Parses the arguments given to main(), skipping argv[0].
+template <typename Registry>
+bool parse_argv(const Registry& registry, int argc, const char* const* argv) {
+  if (argc <= 1) {
+    return true;
+  }
+  return parse_argv(registry, std::span<const char* const>(argv + 1, argc - 1));
+}
+
+// Pool of threads that parse batches of lines against a schema. The threads
+// are started once and wait between batches, so a batch only pays for waking
+// them.
+//
+// A batch is split into chunks of lines that are dealt out evenly to the
+// pool's workers, the thread calling parse() among them. A worker that runs
+// out of chunks steals from the back of the other workers' queues. Each
+// worker parses into its own FlagValues.
+class ParsePool {
+ public:
+  // Starts `threads` - 1 threads; the caller of parse() is the last worker.
+  explicit ParsePool(unsigned threads = std::thread::hardware_concurrency())
+      : queues_(std::max(threads, 1u)) {
+    for (unsigned w = 1; w < queues_.size(); ++w) {
+      workers_.emplace_back([this, w] { run(w); });
+    }
+  }
+  ParsePool(const ParsePool&) = delete;
+  ParsePool& operator=(const ParsePool&) = delete;
+  ~ParsePool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  unsigned size() const { return queues_.size(); }
+
+  // Parses each of `lines` and stores whether it succeeded, as 1 or 0, at the
+  // same position in `results`, which must be as long as `lines`. Batches
+  // from several threads run one after another.
+  void parse(const FlagSchema& schema, std::span<const std::string_view> lines,
+             std::span<uint8_t> results) {
+    assert(results.size() == lines.size());
+    std::lock_guard<std::mutex> batch_lock(batch_mutex_);
+    size_t chunks = (lines.size() + kChunk - 1) / kChunk;
+    for (size_t w = 0; w < queues_.size(); ++w) {
+      queues_[w].front = chunks * w / queues_.size();
+      queues_[w].back = chunks * (w + 1) / queues_.size();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      schema_ = &schema;
+      lines_ = lines;
+      results_ = results;
+      busy_ = workers_.size();
+      ++batch_;
+    }
+    wake_.notify_all();
+    work(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [&] { return busy_ == 0; });
+  }
+
+ private:
+  static constexpr size_t kChunk = 1024;
+
+  // Holds the chunks [front, back) not yet taken.
+  struct Queue {
+    std::mutex mutex;
+    size_t front = 0;
+    size_t back = 0;
+  };
+
+  void run(unsigned w) {
+    uint64_t batch = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [&] { return stopping_ || batch_ != batch; });
+        if (stopping_) {
+          return;
+        }
+        batch = batch_;
+      }
+      work(w);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--busy_ == 0) {
+        done_.notify_one();
+      }
+    }
+  }
+
+  void work(unsigned w) {
+    FlagValues values = schema_->makeValues();
+    auto parse_chunk = [&](size_t chunk) {
+      size_t end = std::min(lines_.size(), (chunk + 1) * kChunk);
+      for (size_t i = chunk * kChunk; i < end; ++i) {
+        schema_->reset(values);
+        results_[i] = parse_arg_list(*schema_, lines_[i], values);
+      }
+    };
+    for (size_t k = 0; k < queues_.size(); ++k) {
+      Queue& queue = queues_[(w + k) % queues_.size()];
+      bool own = k == 0;
+      while (true) {
+        size_t chunk;
+        {
+          std::lock_guard<std::mutex> lock(queue.mutex);
+          if (queue.front == queue.back) {
+            break;
+          }
+          chunk = own ? queue.front++ : --queue.back;
+        }
+        parse_chunk(chunk);
+      }
+    }
+  }
+
+  std::vector<Queue> queues_;
+  std::vector<std::thread> workers_;
+  // Serializes calls to parse().
+  std::mutex batch_mutex_;
+  // Guards the fields below, which describe the current batch.
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::condition_variable done_;
+  const FlagSchema* schema_ = nullptr;
+  std::span<const std::string_view> lines_;
+  std::span<uint8_t> results_;
+  uint64_t batch_ = 0;
+  size_t busy_ = 0;
+  bool stopping_ = false;
+};
+
+// Parses a batch of lines on a pool shared by every caller, with a worker per
+// hardware thread. See ParsePool::parse.
+void parse_batch(const FlagSchema& schema,
+                 std::span<const std::string_view> lines,
+                 std::span<uint8_t> results) {
+  static ParsePool pool;
+  pool.parse(schema, lines, results);
+}
+
+// One published set of flag values. It is never modified once published.
+struct ConfigSnapshot {
+  FlagValues values;
+  uint64_t version;
+};
+
+// Holds the current ConfigSnapshot of a FlagSchema. reload() parses into a
+// fresh snapshot and swaps it in atomically, so readers on any thread see
+// either the old or the new values in full and never take a lock. Replaced
+// snapshots are freed once no reader can still hold them: each reader
+// announces the epoch it started reading in, and a snapshot retired in epoch
+// E is freed when every active reader started after E.
+class ConfigStore {
+  struct Slot;
+
+ public:
+  static constexpr size_t kMaxReaders = 128;
+
+  class Reader;
+
+  // Keeps the snapshot it was made with alive until destroyed. Keep it for no
+  // longer than a burst of reads, since it holds back reclamation.
+  class ReadGuard {
+   public:
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+    ~ReadGuard() { epoch_.store(kIdle, std::memory_order_release); }
+
+    const ConfigSnapshot& operator*() const { return *snapshot_; }
+    const ConfigSnapshot* operator->() const { return snapshot_; }
+
+   private:
+    friend class Reader;
+
+    ReadGuard(std::atomic<uint64_t>& epoch, const ConfigSnapshot* snapshot)
+        : epoch_(epoch), snapshot_(snapshot) {}
+
+    std::atomic<uint64_t>& epoch_;
+    const ConfigSnapshot* snapshot_;
+  };
+
+  // A thread's registration as a reader. Each reading thread needs its own;
+  // reads through one Reader must not overlap. Registering more than
+  // kMaxReaders readers at once aborts the program.
+  class Reader {
+   public:
+    explicit Reader(ConfigStore& store) : store_(store) {
+      for (Slot& slot : store_.readers_) {
+        bool claimed = false;
+        if (slot.claimed.compare_exchange_strong(claimed, true)) {
+          slot_ = &slot;
+          return;
+        }
+      }
+      std::abort();
+    }
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+    ~Reader() { slot_->claimed.store(false, std::memory_order_release); }
+
+    ReadGuard read() const {
+      // Sequentially consistent, so that the announced epoch is visible to
+      // reload() before the snapshot is loaded.
+      slot_->epoch.store(store_.epoch_.load());
+      return ReadGuard(slot_->epoch, store_.current_.load());
+    }
+
+   private:
+    ConfigStore& store_;
+    Slot* slot_ = nullptr;
+  };
+
+  explicit ConfigStore(const FlagSchema& schema)
+      : schema_(schema),
+        current_(new ConfigSnapshot{schema.makeValues(), 0}) {}
+  ConfigStore(const ConfigStore&) = delete;
+  ConfigStore& operator=(const ConfigStore&) = delete;
+  // No reader may be active.
+  ~ConfigStore() {
+    delete current_.load();
+    for (const Retired& retired : retired_) {
+      delete retired.snapshot;
+    }
+  }
+
+  // Parses `arg_list` over the schema defaults and, if it parses, publishes
+  // the result. Reloads are serialized with each other but not with readers.
+  bool reload(std::string_view arg_list) {
+    auto snapshot = std::make_unique<ConfigSnapshot>(
+        ConfigSnapshot{schema_.makeValues(), 0});
+    if (!parse_arg_list(schema_, arg_list, snapshot->values)) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(reload_mutex_);
+    snapshot->version = ++version_;
+    ConfigSnapshot* replaced = current_.exchange(snapshot.release());
+    retired_.push_back({replaced, epoch_.fetch_add(1)});
+    reclaim();
+    return true;
+  }
+
+  // Snapshots replaced but not yet freed, for tests.
+  size_t retiredCount() const {
+    std::lock_guard<std::mutex> lock(reload_mutex_);
+    return retired_.size();
+  }
+
+ private:
+  static constexpr uint64_t kIdle = ~uint64_t{0};
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{kIdle};
+    std::atomic<bool> claimed{false};
+  };
+
+  struct Retired {
+    ConfigSnapshot* snapshot;
+    uint64_t epoch;
+  };
+
+  void reclaim() {
+    uint64_t oldest = kIdle;
+    for (const Slot& slot : readers_) {
+      oldest = std::min(oldest, slot.epoch.load());
+    }
+    std::erase_if(retired_, [oldest](const Retired& retired) {
+      if (retired.epoch >= oldest) {
+        return false;
+      }
+      delete retired.snapshot;
+      return true;
+    });
+  }
+
+  const FlagSchema& schema_;
+  std::atomic<ConfigSnapshot*> current_;
+  std::atomic<uint64_t> epoch_{0};
+  std::array<Slot, kMaxReaders> readers_;
+  mutable std::mutex reload_mutex_;
+  uint64_t version_ = 0;
+  std::vector<Retired> retired_;
+};
+
+// Parses an argument list that arrives in chunks of any size, applying each
+// flag as soon as its value is complete. Only a token split across chunks and
+// the name of a flag waiting for its value are buffered, each up to
+// kMaxTokenSize bytes, so memory use does not grow with the stream. Chunks
+// need not outlive feed(), so nothing may keep a view into them: no flags that
+// borrow their value, such as StringViewFlag, no LazyFlagValues, and no
+// FlagValues with borrowStrings(true).
+template <typename Registry>
+class StreamParser {
+ public:
+  static constexpr size_t kMaxTokenSize = 4096;
+
+  explicit StreamParser(const Registry& registry) : registry_(registry) {}
+
+  // Parses the complete tokens in `chunk` and keeps any trailing partial
+  // token. Returns false once the input is known to be invalid.
+  bool feed(std::string_view chunk) {
+    if (!partial_.empty()) {
+      size_t end = 0;
+      while (end < chunk.size() && !Tokenizer::isSpace(chunk[end])) {
+        ++end;
+      }
+      if (!buffer(partial_, chunk.substr(0, end))) {
+        return false;
+      }
+      if (end == chunk.size()) {
+        return !failed_;
+      }
+      parse(partial_);
+      partial_.clear();
+      chunk.remove_prefix(end);
+    }
+    size_t complete = chunk.size();
+    while (complete > 0 && !Tokenizer::isSpace(chunk[complete - 1])) {
+      --complete;
+    }
+    parse(chunk.substr(0, complete));
+    buffer(partial_, chunk.substr(complete));
+    return !failed_;
+  }
+
+  // Parses whatever was left over. Returns whether the whole input was valid.
+  bool finish() {
+    parse(partial_);
+    partial_.clear();
+    if (!pending_name_.empty()) {
+      Tokenizer tokens("");
+      failed_ |= apply_flag(registry_, pending_name_, tokens) != READ_FLAG;
+      pending_name_.clear();
+    }
+    return !failed_;
+  }
+
+ private:
+  bool buffer(std::string& to, std::string_view text) {
+    if (to.size() + text.size() > kMaxTokenSize) {
+      failed_ = true;
+      return false;
+    }
+    to.append(text);
+    return true;
+  }
+
+  // Applies the flags in `text`, which holds whole tokens only. A flag whose
+  // value has not arrived yet is retried with the next tokens.
+  void parse(std::string_view text) {
+    Tokenizer tokens(text);
+    while (!failed_) {
+      std::string_view name = pending_name_;
+      if (name.empty() && !tokens.next(name)) {
+        return;
+      }
+      if (apply_flag(registry_, name, tokens) == READ_FLAG) {
+        pending_name_.clear();
+      } else if (tokens.exhausted()) {
+        if (pending_name_.empty()) {
+          buffer(pending_name_, name);
+        }
+        return;
+      } else {
+        failed_ = true;
+      }
+    }
+  }
+
+  const Registry& registry_;
+  std::string partial_;
+  std::string pending_name_;
+  bool failed_ = false;
+};
+
+// Coroutine that produces a T. It starts suspended: either start() it, or
+// co_await it from another coroutine, which resumes when it finishes.
+template <typename T>
+class Task {
+ public:
+  struct promise_type {
+    T value{};
+    std::coroutine_handle<> continuation;
+
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    auto final_suspend() noexcept {
+      struct ResumeContinuation {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<promise_type> handle) noexcept {
+          std::coroutine_handle<> continuation = handle.promise().continuation;
+          return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+      };
+      return ResumeContinuation{};
+    }
+    void return_value(T result) { value = std::move(result); }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+  ~Task() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  // Runs the task until it first suspends or finishes.
+  void start() { handle_.resume(); }
+  bool done() const { return handle_.done(); }
+  // The value returned by the finished task.
+  const T& result() const { return handle_.promise().value; }
+
+  bool await_ready() const { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) {
+    handle_.promise().continuation = waiter;
+    return handle_;
+  }
+  T await_resume() { return std::move(handle_.promise().value); }
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// Parses the bytes read from `source` as they arrive. Each co_await
+// source.read() must yield the next chunk, or an empty view at the end of the
+// input, and source.failed() tells whether reading stopped on an error. Both
+// `registry` and `source` must outlive the task.
+template <typename Registry, typename Source>
+Task<bool> parse_async(const Registry& registry, Source& source) {
+  StreamParser<Registry> parser(registry);
+  while (true) {
+    std::string_view chunk = co_await source.read();
+    if (chunk.empty()) {
+      co_return !source.failed() && parser.finish();
+    }
+    if (!parser.feed(chunk)) {
+      co_return false;
+    }
+  }
+}
+
+// Parses into `values`, which must copy its strings, since sources may reuse
+// the memory of a chunk once it is parsed. Fails if `values` borrows them.
+template <typename Source>
+Task<bool> parse_async(const FlagSchema& schema, FlagValues& values,
+                       Source& source) {
+  if (values.borrowsStrings()) {
+    co_return false;
+  }
+  SchemaRegistry<FlagValues> registry{schema, values};
+  co_return co_await parse_async(registry, source);
+}
+
+// Single-threaded loop that resumes coroutines once the file descriptors they
+// wait on become readable.
+class EventLoop {
+ public:
+  // Resumes `waiter` once `fd` is readable. poll() may report a descriptor
+  // readable with nothing to read, so when `ready` is given it is called
+  // with `context` first, and the wait goes on while it returns false.
+  void waitReadable(int fd, std::coroutine_handle<> waiter,
+                    bool (*ready)(void*) = nullptr, void* context = nullptr) {
+    waiting_.push_back({fd, waiter, ready, context});
+  }
+
+  // Runs until no coroutine is waiting.
+  void run() {
+    while (!waiting_.empty()) {
+      runOnce(-1);
+    }
+  }
+
+  // Waits up to `timeout_ms` (-1 for no limit) for waited-on descriptors to
+  // become readable and resumes their coroutines. Returns whether any was
+  // resumed.
+  bool runOnce(int timeout_ms) {
+    fds_.clear();
+    for (const Waiter& waiter : waiting_) {
+      fds_.push_back({waiter.fd, POLLIN, 0});
+    }
+    if (poll(fds_.data(), fds_.size(), timeout_ms) <= 0) {
+      return false;
+    }
+    // Resuming may add waiters, so take the ready ones out first.
+    std::vector<std::coroutine_handle<>> ready;
+    size_t kept = 0;
+    for (size_t i = 0; i < waiting_.size(); ++i) {
+      const Waiter& waiter = waiting_[i];
+      if (fds_[i].revents != 0 &&
+          (waiter.ready == nullptr || waiter.ready(waiter.context))) {
+        ready.push_back(waiter.coroutine);
+      } else {
+        waiting_[kept++] = waiting_[i];
+      }
+    }
+    waiting_.resize(kept);
+    for (std::coroutine_handle<> coroutine : ready) {
+      coroutine.resume();
+    }
+    return !ready.empty();
+  }
+
+ private:
+  struct Waiter {
+    int fd;
+    std::coroutine_handle<> coroutine;
+    bool (*ready)(void*);
+    void* context;
+  };
+
+  std::vector<Waiter> waiting_;
+  std::vector<pollfd> fds_;
+};
+
+// Byte source for parse_async that reads the read end of a pipe, or any
+// other file descriptor, without blocking: when no bytes are available the
+// reading coroutine waits on `loop`.
+class PipeByteSource {
+ public:
+  static constexpr size_t kBufferSize = 4096;
+
+  PipeByteSource(int fd, EventLoop& loop) : fd_(fd), loop_(loop) {
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+  }
+
+  auto read() {
+    struct Read {
+      PipeByteSource& source;
+
+      bool await_ready() { return source.tryRead(); }
+      // The reader is only resumed once a read() has returned something.
+      void await_suspend(std::coroutine_handle<> reader) {
+        source.loop_.waitReadable(
+            source.fd_, reader,
+            [](void* source) {
+              return static_cast<PipeByteSource*>(source)->tryRead();
+            },
+            &source);
+      }
+      std::string_view await_resume() { return source.chunk_; }
+    };
+    return Read{*this};
+  }
+
+  bool failed() const { return failed_; }
+
+ private:
+  // Reads what is available into the buffer. Returns false if that is
+  // nothing yet.
+  bool tryRead() {
+    ssize_t size = ::read(fd_, buffer_, sizeof(buffer_));
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return false;
+    }
+    failed_ = size < 0;
+    chunk_ = std::string_view(buffer_, size > 0 ? size : 0);
+    return true;
+  }
+
+  int fd_;
+  EventLoop& loop_;
+  char buffer_[kBufferSize];
+  std::string_view chunk_;
+  bool failed_ = false;
+};
+
+// Read-only mapping of a whole file.
+class MappedFile {
+ public:
+  // Maps the file at `path`. Check valid() for failure.
+  explicit MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat status;
+    if (fstat(fd, &status) == 0) {
+      device_ = status.st_dev;
+      inode_ = status.st_ino;
+      size_ = status.st_size;
+      valid_ = true;
+      if (size_ > 0) {
+        data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        valid_ = data_ != MAP_FAILED;
+      }
+    }
+    close(fd);
+  }
+  ~MappedFile() {
+    if (data_ != nullptr && data_ != MAP_FAILED) {
+      munmap(data_, size_);
+    }
+  }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool valid() const { return valid_; }
+  std::string_view contents() const {
+    if (size_ == 0) {
+      return {};
+    }
+    return {static_cast<const char*>(data_), size_};
+  }
+  // Identifies the file independently of the path it was opened by.
+  std::pair<dev_t, ino_t> id() const { return {device_, inode_}; }
+
+ private:
+  void* data_ = nullptr;
+  size_t size_ = 0;
+  dev_t device_ = 0;
+  ino_t inode_ = 0;
+  bool valid_ = false;
+};
+
+// Keeps the flagfiles read by parse_flagfile mapped. Values borrowed from
+// them, such as those of a StringViewFlag, stay valid while it lives.
+class Flagfiles {
+ public:
+  const MappedFile& open(const std::string& path) {
+    files_.push_back(std::make_unique<MappedFile>(path));
+    return *files_.back();
+  }
+
+ private:
+  std::vector<std::unique_ptr<MappedFile>> files_;
+};
+
+template <typename Registry>
+bool parse_flagfile(const Registry& registry, const std::string& path,
+                    Flagfiles& files,
+                    std::vector<std::pair<dev_t, ino_t>>& including) {
+  const MappedFile& file = files.open(path);
+  if (!file.valid()) {
+    return false;
+  }
+  if (std::find(including.begin(), including.end(), file.id()) !=
+      including.end()) {
+    return false;
+  }
+  including.push_back(file.id());
+  Tokenizer tokens(file.contents());
+  std::string_view token;
+  State state = READ_FLAG;
+  while (state == READ_FLAG && tokens.next(token)) {
+    if (token[0] == '@') {
+      std::string included(token.substr(1));
+      if (!parse_flagfile(registry, included, files, including)) {
+        state = PARSE_ERROR;
+      }
+    } else {
+      state = apply_flag(registry, token, tokens);
+    }
+  }
+  including.pop_back();
+  return state == READ_FLAG;
+}
+
+// Parses the file at `path`, which is mapped rather than read, so tokens are
+// views into `files`. A token "@other" in place of a flag parses the file
+// "other" at that point; a file that includes itself, directly or not, fails
+// the parse.
+template <typename Registry>
+bool parse_flagfile(const Registry& registry, const std::string& path,
+                    Flagfiles& files) {
+  std::vector<std::pair<dev_t, ino_t>> including;
+  return parse_flagfile(registry, path, files, including);
+}
+
+// Identifies the version of a flagfile a snapshot was made from: the file
+// itself, and its size and modification time.
+struct SnapshotSource {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  uint64_t modified_ns;
+
+  bool operator==(const SnapshotSource&) const = default;
+};
+
+bool snapshot_source(const std::string& flagfile_path, SnapshotSource& source) {
+  struct stat status;
+  if (stat(flagfile_path.c_str(), &status) != 0) {
+    return false;
+  }
+  source = {static_cast<uint64_t>(status.st_dev),
+            static_cast<uint64_t>(status.st_ino),
+            static_cast<uint64_t>(status.st_size),
+            static_cast<uint64_t>(status.st_mtim.tv_sec) * 1000000000 +
+                static_cast<uint64_t>(status.st_mtim.tv_nsec)};
+  return true;
+}
+
+// Layout of a snapshot written by write_snapshot: this header, then the int32
+// values, a {offset, size} pair per string value, a byte per bool value, and
+// the string bytes. Offsets are relative to the start of the string bytes.
+// Integers are in native byte order, since a snapshot is only meant to be
+// read on the machine that wrote it.
+struct SnapshotHeader {
+  static constexpr char kMagic[8] = {'A', 'R', 'G', 'S', 'S', 'N', 'A', 'P'};
+  static constexpr uint32_t kVersion = 2;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t bool_count;
+  uint32_t int32_count;
+  uint32_t string_count;
+  uint64_t schema_hash;
+  uint64_t size;
+  SnapshotSource source;
+};
+
+struct SnapshotString {
+  uint32_t offset;
+  uint32_t size;
+};
+
+// The size of a snapshot up to its string bytes.
+size_t snapshot_fixed_size(size_t bools, size_t int32s, size_t strings) {
+  return sizeof(SnapshotHeader) + int32s * sizeof(int32_t) +
+         strings * sizeof(SnapshotString) + bools;
+}
+
+// Serializes `values`, laid out by `schema` and parsed from the flagfile
+// `source`, in the snapshot format.
+std::string serialize_snapshot(const FlagSchema& schema,
+                               const FlagValues& values,
+                               const SnapshotSource& source) {
+  size_t bools = values.size(BOOL_FLAG);
+  size_t int32s = values.size(INT32_FLAG);
+  size_t strings = values.size(STRING_FLAG);
+  size_t string_bytes = 0;
+  for (size_t i = 0; i < strings; ++i) {
+    string_bytes += values.getString(i).size();
+  }
+  SnapshotHeader header = {};
+  std::memcpy(header.magic, SnapshotHeader::kMagic, sizeof(header.magic));
+  header.version = SnapshotHeader::kVersion;
+  header.bool_count = static_cast<uint32_t>(bools);
+  header.int32_count = static_cast<uint32_t>(int32s);
+  header.string_count = static_cast<uint32_t>(strings);
+  header.schema_hash = schema.hash();
+  header.size = snapshot_fixed_size(bools, int32s, strings) + string_bytes;
+  header.source = source;
+
+  std::string image;
+  image.reserve(header.size);
+  image.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (size_t i = 0; i < int32s; ++i) {
+    int32_t value = values.getInt32(i);
+    image.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  uint32_t offset = 0;
+  for (size_t i = 0; i < strings; ++i) {
+    SnapshotString entry = {offset,
+                            static_cast<uint32_t>(values.getString(i).size())};
+    image.append(reinterpret_cast<const char*>(&entry), sizeof(entry));
+    offset += entry.size;
+  }
+  for (size_t i = 0; i < bools; ++i) {
+    image.push_back(values.getBool(i) ? 1 : 0);
+  }
+  for (size_t i = 0; i < strings; ++i) {
+    image.append(values.getString(i));
+  }
+  return image;
+}
+
+// Parses the flagfile at `flagfile_path` into a FlagValues block and
+// serializes it. Fails if the file changes while it is parsed.
+bool parse_snapshot(const FlagSchema& schema, const std::string& flagfile_path,
+                    std::string& image) {
+  SnapshotSource before;
+  SnapshotSource after;
+  FlagValues values = schema.makeValues();
+  Flagfiles files;
+  if (!snapshot_source(flagfile_path, before) ||
+      !parse_flagfile(SchemaRegistry<FlagValues>{schema, values},
+                      flagfile_path, files) ||
+      !snapshot_source(flagfile_path, after) || before != after) {
+    return false;
+  }
+  image = serialize_snapshot(schema, values, before);
+  return true;
+}
+
+// Parses the flagfile at `flagfile_path` and writes a snapshot of the result
+// to `path`, through a temporary file renamed into place so that readers
+// never map a partly written snapshot.
+bool write_snapshot(const FlagSchema& schema, const std::string& flagfile_path,
+                    const std::string& path) {
+  std::string image;
+  if (!parse_snapshot(schema, flagfile_path, image)) {
+    return false;
+  }
+  std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+    if (!out.write(image.data(), image.size()) || !out.flush()) {
+      return false;
+    }
+  }
+  return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+// Flag values read straight from a snapshot image, which is either a mapped
+// snapshot file or, when that is missing or stale, built by parsing text.
+// Loading only validates the image and points the typed sections into it.
+//
+// A snapshot is stale when the schema or the flagfile it was made from has
+// changed since. Only the flagfile itself is checked, not the files it
+// includes with "@path".
+class FlagSnapshot {
+ public:
+  // Maps the snapshot at `path`. Fails if it is missing or malformed, or was
+  // written for a schema other than `schema` or from another version of the
+  // flagfile at `flagfile_path`.
+  bool load(const FlagSchema& schema, const std::string& path,
+            const std::string& flagfile_path) {
+    auto file = std::make_unique<MappedFile>(path);
+    SnapshotSource source;
+    if (!file->valid() || !snapshot_source(flagfile_path, source) ||
+        !attach(schema, file->contents(), &source)) {
+      return false;
+    }
+    file_ = std::move(file);
+    buffer_.clear();
+    return true;
+  }
+
+  // Parses the flagfile at `path` against `schema`, and keeps the result in
+  // snapshot form.
+  bool parse(const FlagSchema& schema, const std::string& path) {
+    std::string image;
+    if (!parse_snapshot(schema, path, image)) {
+      return false;
+    }
+    buffer_ = std::move(image);
+    file_.reset();
+    return attach(schema, buffer_, nullptr);
+  }
+
+  // Loads the snapshot at `snapshot_path`, or falls back to parsing the
+  // flagfile it was made from if the snapshot is missing, malformed or stale.
+  bool loadOrParse(const FlagSchema& schema, const std::string& snapshot_path,
+                   const std::string& flagfile_path) {
+    return load(schema, snapshot_path, flagfile_path) ||
+           parse(schema, flagfile_path);
+  }
+
+  // Whether the values come from a mapped snapshot rather than a parse.
+  bool mapped() const { return file_ != nullptr; }
+
+  bool getBool(size_t index) const { return bools_[index] != 0; }
+  int32_t getInt32(size_t index) const { return int32s_[index]; }
+  std::string_view getString(size_t index) const {
+    return {string_bytes_ + strings_[index].offset, strings_[index].size};
+  }
+
+ private:
+  // Checks the image and points the typed sections into it. When `source` is
+  // given, the image must have been made from that version of the flagfile.
+  bool attach(const FlagSchema& schema, std::string_view image,
+              const SnapshotSource* source) {
+    SnapshotHeader header;
+    if (image.size() < sizeof(header)) {
+      return false;
+    }
+    std::memcpy(&header, image.data(), sizeof(header));
+    const FlagValues& defaults = schema.defaults();
+    if (std::memcmp(header.magic, SnapshotHeader::kMagic,
+                    sizeof(header.magic)) != 0 ||
+        header.version != SnapshotHeader::kVersion ||
+        header.schema_hash != schema.hash() ||
+        header.bool_count != defaults.size(BOOL_FLAG) ||
+        header.int32_count != defaults.size(INT32_FLAG) ||
+        header.string_count != defaults.size(STRING_FLAG) ||
+        header.size != image.size() ||
+        (source != nullptr && header.source != *source)) {
+      return false;
+    }
+    size_t fixed = snapshot_fixed_size(header.bool_count, header.int32_count,
+                                       header.string_count);
+    if (fixed > image.size()) {
+      return false;
+    }
+    const char* base = image.data();
+    const char* int32s = base + sizeof(header);
+    const char* strings = int32s + header.int32_count * sizeof(int32_t);
+    const char* bools = strings + header.string_count * sizeof(SnapshotString);
+    auto entries = reinterpret_cast<const SnapshotString*>(strings);
+    size_t string_bytes = image.size() - fixed;
+    for (uint32_t i = 0; i < header.string_count; ++i) {
+      if (entries[i].offset > string_bytes ||
+          entries[i].size > string_bytes - entries[i].offset) {
+        return false;
+      }
+    }
+    int32s_ = reinterpret_cast<const int32_t*>(int32s);
+    strings_ = entries;
+    bools_ = reinterpret_cast<const uint8_t*>(bools);
+    string_bytes_ = base + fixed;
+    return true;
+  }
+
+  std::unique_ptr<MappedFile> file_;
+  std::string buffer_;
+  const uint8_t* bools_ = nullptr;
+  const int32_t* int32s_ = nullptr;
+  const SnapshotString* strings_ = nullptr;
+  const char* string_bytes_ = nullptr;
+};
+
+// Header of a SharedFlagSegment. The values follow it in the order of a
+// snapshot, each as an atomic so that a reader racing a publish reads whole
+// values, and string bytes last, in an area of fixed capacity.
+struct SharedSegmentHeader {
+  static constexpr char kMagic[8] = {'A', 'R', 'G', 'S', 'S', 'H', 'M', '\0'};
+  static constexpr uint32_t kVersion = 1;
+
+  char magic[8];
+  // Set last when creating the segment, so a nonzero version means the rest
+  // of the header is complete.
+  std::atomic<uint32_t> version;
+  uint32_t bool_count;
+  uint32_t int32_count;
+  uint32_t string_count;
+  uint64_t schema_hash;
+  uint64_t string_capacity;
+  uint64_t size;
+  // Odd while a publish is under way.
+  alignas(64) std::atomic<uint64_t> sequence;
+};
+
+struct SharedString {
+  std::atomic<uint32_t> offset;
+  std::atomic<uint32_t> size;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                  std::atomic<uint32_t>::is_always_lock_free &&
+                  std::atomic<uint8_t>::is_always_lock_free,
+              "shared atomics must not depend on a process-local lock");
+
+// The values of a SharedFlagSegment as seen inside SharedFlagSegment::read.
+// String views point into the segment and are only valid inside the read.
+class SharedFlagView {
+ public:
+  bool getBool(size_t index) const {
+    return bools_[index].load(std::memory_order_relaxed) != 0;
+  }
+  int32_t getInt32(size_t index) const {
+    return int32s_[index].load(std::memory_order_relaxed);
+  }
+  // Clamped to the string area, since a read racing a publish may see an
+  // offset and size from different versions before it is retried.
+  std::string_view getString(size_t index) const {
+    size_t offset = std::min<size_t>(
+        strings_[index].offset.load(std::memory_order_relaxed), capacity_);
+    size_t size = std::min<size_t>(
+        strings_[index].size.load(std::memory_order_relaxed),
+        capacity_ - offset);
+    return {string_bytes_ + offset, size};
+  }
+
+ private:
+  friend class SharedFlagSegment;
+
+  // Writable only in the process that created the segment.
+  std::atomic<uint8_t>* bools_ = nullptr;
+  std::atomic<int32_t>* int32s_ = nullptr;
+  SharedString* strings_ = nullptr;
+  char* string_bytes_ = nullptr;
+  size_t capacity_ = 0;
+};
+
+// Flag values of a FlagSchema in a POSIX shared-memory segment, so that
+// cooperating processes on a host read the values one of them parsed. The
+// primary create()s the segment and publish()es values; sidecars open() it
+// read-only. Publishes go through a sequence lock: readers never block a
+// publish, and retry a read that overlapped one.
+class SharedFlagSegment {
+ public:
+  SharedFlagSegment() = default;
+  SharedFlagSegment(const SharedFlagSegment&) = delete;
+  SharedFlagSegment& operator=(const SharedFlagSegment&) = delete;
+  ~SharedFlagSegment() { unmap(); }
+
+  // Creates the segment `name`, replacing any segment of that name, with
+  // room for `string_capacity` bytes of string values, and publishes the
+  // schema defaults.
+  bool create(const std::string& name, const FlagSchema& schema,
+              size_t string_capacity) {
+    unmap();
+    const FlagValues& defaults = schema.defaults();
+    size_t size = segment_size(defaults.size(BOOL_FLAG),
+                               defaults.size(INT32_FLAG),
+                               defaults.size(STRING_FLAG), string_capacity);
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    bool mapped = ftruncate(fd, size) == 0 && map(fd, size, true);
+    close(fd);
+    if (!mapped) {
+      shm_unlink(name.c_str());
+      return false;
+    }
+    std::memcpy(header_->magic, SharedSegmentHeader::kMagic,
+                sizeof(header_->magic));
+    header_->bool_count = static_cast<uint32_t>(defaults.size(BOOL_FLAG));
+    header_->int32_count = static_cast<uint32_t>(defaults.size(INT32_FLAG));
+    header_->string_count = static_cast<uint32_t>(defaults.size(STRING_FLAG));
+    header_->schema_hash = schema.hash();
+    header_->string_capacity = string_capacity;
+    header_->size = size;
+    locate();
+    if (!publish(defaults)) {
+      unmap();
+      shm_unlink(name.c_str());
+      return false;
+    }
+    header_->version.store(SharedSegmentHeader::kVersion,
+                           std::memory_order_release);
+    return true;
+  }
+
+  // Maps the segment `name` read-only. Fails if it does not exist, is not
+  // fully created yet, or was laid out for a schema other than `schema`.
+  bool open(const std::string& name, const FlagSchema& schema) {
+    unmap();
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat status;
+    bool mapped = fstat(fd, &status) == 0 &&
+                  static_cast<size_t>(status.st_size) >=
+                      sizeof(SharedSegmentHeader) &&
+                  map(fd, status.st_size, false);
+    close(fd);
+    if (!mapped) {
+      return false;
+    }
+    const FlagValues& defaults = schema.defaults();
+    if (header_->version.load(std::memory_order_acquire) !=
+            SharedSegmentHeader::kVersion ||
+        std::memcmp(header_->magic, SharedSegmentHeader::kMagic,
+                    sizeof(header_->magic)) != 0 ||
+        header_->schema_hash != schema.hash() ||
+        header_->bool_count != defaults.size(BOOL_FLAG) ||
+        header_->int32_count != defaults.size(INT32_FLAG) ||
+        header_->string_count != defaults.size(STRING_FLAG) ||
+        header_->size != size_ ||
+        header_->size != segment_size(header_->bool_count,
+                                      header_->int32_count,
+                                      header_->string_count,
+                                      header_->string_capacity)) {
+      unmap();
+      return false;
+    }
+    locate();
+    return true;
+  }
+
+  // Removes the segment `name`. Processes that have it mapped keep it.
+  static void remove(const std::string& name) { shm_unlink(name.c_str()); }
+
+  // Copies `values`, laid out by the segment's schema, into the segment.
+  // Only the process that created it may publish, and only from one thread
+  // at a time. Fails if the segment was open()ed read-only, or if the strings
+  // do not fit.
+  bool publish(const FlagValues& values) {
+    if (!writable_ || values.size(BOOL_FLAG) != header_->bool_count ||
+        values.size(INT32_FLAG) != header_->int32_count ||
+        values.size(STRING_FLAG) != header_->string_count) {
+      return false;
+    }
+    size_t string_bytes = 0;
+    for (size_t i = 0; i < header_->string_count; ++i) {
+      string_bytes += values.getString(i).size();
+    }
+    if (string_bytes > header_->string_capacity) {
+      return false;
+    }
+    uint64_t sequence = header_->sequence.load(std::memory_order_relaxed);
+    header_->sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < header_->bool_count; ++i) {
+      view_.bools_[i].store(values.getBool(i), std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < header_->int32_count; ++i) {
+      view_.int32s_[i].store(values.getInt32(i), std::memory_order_relaxed);
+    }
+    uint32_t offset = 0;
+    for (size_t i = 0; i < header_->string_count; ++i) {
+      std::string_view value = values.getString(i);
+      std::memcpy(view_.string_bytes_ + offset, value.data(), value.size());
+      view_.strings_[i].offset.store(offset, std::memory_order_relaxed);
+      view_.strings_[i].size.store(static_cast<uint32_t>(value.size()),
+                                   std::memory_order_relaxed);
+      offset += static_cast<uint32_t>(value.size());
+    }
+    header_->sequence.store(sequence + 2, std::memory_order_release);
+    return true;
+  }
+
+  // Calls `read` with a SharedFlagView of one published version of the
+  // values, calling it again if a publish overlapped it. `read` should only
+  // copy values out.
+  template <typename Read>
+  void read(Read&& read) const {
+    while (true) {
+      uint64_t before = header_->sequence.load(std::memory_order_acquire);
+      if (before % 2 == 0) {
+        read(std::as_const(view_));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header_->sequence.load(std::memory_order_relaxed) == before) {
+          return;
+        }
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  // Single values are read atomically without the sequence lock.
+  bool getBool(size_t index) const { return view_.getBool(index); }
+  int32_t getInt32(size_t index) const { return view_.getInt32(index); }
+  std::string getString(size_t index) const {
+    std::string value;
+    read([&](const SharedFlagView& view) { value = view.getString(index); });
+    return value;
+  }
+
+  // The number of publishes so far, counting the defaults.
+  uint64_t generation() const {
+    return header_->sequence.load(std::memory_order_acquire) / 2;
+  }
+
+ private:
+  static size_t segment_size(size_t bools, size_t int32s, size_t strings,
+                             size_t string_capacity) {
+    return sizeof(SharedSegmentHeader) + int32s * sizeof(int32_t) +
+           strings * sizeof(SharedString) + bools + string_capacity;
+  }
+
+  bool map(int fd, size_t size, bool writable) {
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* data = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    header_ = static_cast<SharedSegmentHeader*>(data);
+    size_ = size;
+    writable_ = writable;
+    return true;
+  }
+
+  void unmap() {
+    if (header_ != nullptr) {
+      munmap(header_, size_);
+      header_ = nullptr;
+      writable_ = false;
+    }
+  }
+
+  // Points the view at the sections that follow the header.
+  void locate() {
+    char* int32s = reinterpret_cast<char*>(header_ + 1);
+    char* strings = int32s + header_->int32_count * sizeof(int32_t);
+    char* bools = strings + header_->string_count * sizeof(SharedString);
+    view_.int32s_ = reinterpret_cast<std::atomic<int32_t>*>(int32s);
+    view_.strings_ = reinterpret_cast<SharedString*>(strings);
+    view_.bools_ = reinterpret_cast<std::atomic<uint8_t>*>(bools);
+    view_.string_bytes_ = bools + header_->bool_count;
+    view_.capacity_ = header_->string_capacity;
+  }
+
+  SharedSegmentHeader* header_ = nullptr;
+  size_t size_ = 0;
+  bool writable_ = false;
+  SharedFlagView view_;
+};
+
+// The slots of a perfect hash over `names`, built at run time by the same
+// scheme and hash functions as PerfectHash, for emitting into generated code.
+struct PerfectHashTables {
+  std::vector<uint64_t> displacements;
+  // The index in `names` of the name in each slot, or names.size() if free.
+  std::vector<size_t> slots;
+
+  size_t bucket(uint64_t h) const { return (h >> 32) % displacements.size(); }
+  size_t slot(uint64_t h, uint64_t displacement) const {
+    return displace_hash(h, displacement) & (slots.size() - 1);
+  }
+};
+
+// Returns false if `names` has duplicates.
+bool build_perfect_hash(const std::vector<std::string_view>& names,
+                        PerfectHashTables& tables) {
+  size_t n = names.size();
+  tables.displacements.assign(n / 2 + 1, 0);
+  tables.slots.assign(std::bit_ceil(n + 1), n);
+  std::vector<uint64_t> hashes(n);
+  std::vector<std::vector<size_t>> buckets(tables.displacements.size());
+  for (size_t i = 0; i < n; ++i) {
+    hashes[i] = hash_name(names[i]);
+    buckets[tables.bucket(hashes[i])].push_back(i);
+  }
+  std::vector<size_t> order(buckets.size());
+  for (size_t b = 0; b < order.size(); ++b) {
+    order[b] = b;
+  }
+  // Place the largest buckets first, while most slots are still free.
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  std::vector<size_t> placed;
+  for (size_t b : order) {
+    const std::vector<size_t>& bucket = buckets[b];
+    for (size_t i = 0; i < bucket.size(); ++i) {
+      for (size_t j = 0; j < i; ++j) {
+        if (names[bucket[i]] == names[bucket[j]]) {
+          return false;
+        }
+      }
+    }
+    for (uint64_t displacement = 0;; ++displacement) {
+      placed.clear();
+      for (size_t i : bucket) {
+        size_t s = tables.slot(hashes[i], displacement);
+        if (tables.slots[s] != n) {
+          break;
+        }
+        tables.slots[s] = i;
+        placed.push_back(s);
+      }
+      if (placed.size() == bucket.size()) {
+        tables.displacements[b] = displacement;
+        break;
+      }
+      for (size_t s : placed) {
+        tables.slots[s] = n;
+      }
+    }
+  }
+  return true;
+}
+
+// Writes `value` as a C++ string literal.
+void write_string_literal(std::ostream& out, std::string_view value) {
+  out << '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+      out << '\\' << std::oct << (c >> 6 & 7) << (c >> 3 & 7) << (c & 7)
+          << std::dec;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+// C++20 keywords and alternative operator names, which cannot name a member
+// or a type.
+constexpr std::string_view kKeywords[] = {
+    "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor",
+    "bool", "break", "case", "catch", "char", "char8_t", "char16_t", "char32_t",
+    "class", "compl", "concept", "const", "consteval", "constexpr", "constinit",
+    "const_cast", "continue", "co_await", "co_return", "co_yield", "decltype",
+    "default", "delete", "do", "double", "dynamic_cast", "else", "enum",
+    "explicit", "export", "extern", "false", "float", "for", "friend", "goto",
+    "if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept",
+    "not", "not_eq", "nullptr", "operator", "or", "or_eq", "private",
+    "protected", "public", "register", "reinterpret_cast", "requires", "return",
+    "short", "signed", "sizeof", "static", "static_assert", "static_cast",
+    "struct", "switch", "template", "this", "thread_local", "throw", "true",
+    "try", "typedef", "typeid", "typename", "union", "unsigned", "using",
+    "virtual", "void", "volatile", "wchar_t", "while", "xor", "xor_eq"};
+
+bool is_identifier(std::string_view name) {
+  if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0])) ||
+      std::find(std::begin(kKeywords), std::end(kKeywords), name) !=
+          std::end(kKeywords)) {
+    return false;
+  }
+  return std::all_of(name.begin(), name.end(), [](char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+  });
+}
+
+// Generates a parser specialized for the flags described in `schema`, one
+// per line as "name kind [default]", where kind is bool, int32 or string and
+// bool flags take no default. Blank lines and lines starting with '#' are
+// skipped. Names and `type_name` must be C++ identifiers. The output, meant
+// to be included after this file's definitions, declares:
+//
+//   struct <type_name>;  // One BoolFlag, Int32Flag or StringFlag per flag.
+//   bool parse_flags(std::string_view arg_list, <type_name>& flags);
+//   struct <type_name>Registry;  // For the generic parse_arg_list.
+//
+// parse_flags resolves names through a perfect hash computed here to a table
+// entry holding the flag's kind and member pointer, and calls the member's
+// setValue directly, which the final flag classes let the compiler inline.
+// Returns false, after describing the problem on `errors`, if the schema is
+// malformed.
+bool generate_parser(std::string_view schema, std::string_view type_name,
+                     std::ostream& out, std::ostream& errors) {
+  if (!is_identifier(type_name)) {
+    errors << "\"" << type_name << "\" is not a C++ identifier" << std::endl;
+    return false;
+  }
+  struct Field {
+    std::string_view name;
+    std::string_view kind;
+    std::string_view default_value;
+    int32_t int32_default = 0;
+  };
+  std::vector<Field> fields;
+  size_t line_number = 0;
+  while (!schema.empty()) {
+    size_t end = std::min(schema.find('\n'), schema.size());
+    std::string_view line = schema.substr(0, end);
+    schema.remove_prefix(std::min(end + 1, schema.size()));
+    ++line_number;
+    Tokenizer tokens(line);
+    Field field;
+    if (!tokens.next(field.name) || field.name[0] == '#') {
+      continue;
+    }
+    std::string_view extra;
+    bool has_default =
+        tokens.next(field.kind) && tokens.next(field.default_value);
+    if (field.kind.empty() || tokens.next(extra)) {
+      errors << "line " << line_number << ": expected \"name kind [default]\""
+             << std::endl;
+      return false;
+    }
+    if (!is_identifier(field.name)) {
+      errors << "line " << line_number << ": \"" << field.name
+             << "\" is not a C++ identifier" << std::endl;
+      return false;
+    }
+    bool valid = field.kind == "string";
+    if (field.kind == "bool") {
+      valid = !has_default;
+    } else if (field.kind == "int32") {
+      valid = !has_default ||
+              parse_int32(field.default_value, field.int32_default);
+    }
+    if (!valid) {
+      errors << "line " << line_number << ": bad kind or default for \""
+             << field.name << "\"" << std::endl;
+      return false;
+    }
+    fields.push_back(field);
+  }
+
+  std::vector<std::string_view> names;
+  for (const Field& field : fields) {
+    names.push_back(field.name);
+  }
+  PerfectHashTables tables;
+  if (!build_perfect_hash(names, tables)) {
+    errors << "duplicate flag name" << std::endl;
+    return false;
+  }
+
+  out << "// Generated by \"args generate " << type_name
+      << "\". Do not edit.\n\n";
+  out << "struct " << type_name << " {\n";
+  for (const Field& field : fields) {
+    if (field.kind == "bool") {
+      out << "  BoolFlag " << field.name << ";\n";
+    } else if (field.kind == "int32") {
+      out << "  Int32Flag " << field.name;
+      if (field.int32_default == INT32_MIN) {
+        out << "{INT32_MIN}";
+      } else if (field.int32_default != 0) {
+        out << "{" << field.int32_default << "}";
+      }
+      out << ";\n";
+    } else {
+      out << "  StringFlag " << field.name;
+      if (!field.default_value.empty()) {
+        out << "{";
+        write_string_literal(out, field.default_value);
+        out << "}";
+      }
+      out << ";\n";
+    }
+  }
+  out << "};\n\n";
+
+  // One entry per slot of the perfect hash, with the member to set for the
+  // name in that slot. The parser switches on the kind to one of three
+  // setters; a case per flag would inline thousands of copies of them.
+  out << "struct " << type_name << "Index {\n"
+      << "  static constexpr size_t kFlags = " << names.size() << ";\n"
+      << "  static constexpr size_t kSlots = " << tables.slots.size() << ";\n\n"
+      << "  struct Entry {\n"
+      << "    std::string_view name;\n"
+      << "    FlagKind kind;\n"
+      << "    BoolFlag " << type_name << "::*bool_flag;\n"
+      << "    Int32Flag " << type_name << "::*int32_flag;\n"
+      << "    StringFlag " << type_name << "::*string_flag;\n"
+      << "  };\n\n"
+      << "  // Returns the entry of the flag named `name`, or nullptr if\n"
+      << "  // there is none.\n"
+      << "  static const Entry* find(std::string_view name) {\n"
+      << "    static constexpr uint64_t kDisplacements["
+      << tables.displacements.size() << "] = {";
+  for (size_t b = 0; b < tables.displacements.size(); ++b) {
+    out << (b % 8 == 0 ? "\n        " : " ") << tables.displacements[b] << ",";
+  }
+  out << "\n    };\n"
+      << "    static constexpr Entry kEntries[kSlots] = {";
+  for (size_t slot : tables.slots) {
+    out << "\n        {";
+    if (slot != names.size()) {
+      const Field& field = fields[slot];
+      write_string_literal(out, field.name);
+      std::string member = "&" + std::string(type_name) + "::" +
+                           std::string(field.name);
+      if (field.kind == "bool") {
+        out << ", BOOL_FLAG, " << member << ", nullptr, nullptr";
+      } else if (field.kind == "int32") {
+        out << ", INT32_FLAG, nullptr, " << member << ", nullptr";
+      } else {
+        out << ", STRING_FLAG, nullptr, nullptr, " << member;
+      }
+    }
+    out << "},";
+  }
+  out << "\n    };\n"
+      << "    uint64_t h = hash_name(name);\n"
+      << "    const Entry& entry = kEntries[displace_hash(\n"
+      << "        h, kDisplacements[(h >> 32) % "
+      << tables.displacements.size() << "]) & (kSlots - 1)];\n"
+      << "    return !name.empty() && entry.name == name ? &entry : nullptr;\n"
+      << "  }\n"
+      << "};\n\n";
+
+  out << "bool parse_flags(std::string_view arg_list, " << type_name
+      << "& flags) {\n"
+      << "  Tokenizer tokens(arg_list);\n"
+      << "  std::string_view name_token;\n"
+      << "  while (tokens.next(name_token)) {\n"
+      << "    if (name_token.size() <= 1 || name_token[0] != '-') {\n"
+      << "      return false;\n"
+      << "    }\n"
+      << "    const " << type_name << "Index::Entry* entry =\n"
+      << "        " << type_name << "Index::find(name_token.substr(1));\n"
+      << "    if (entry == nullptr) {\n"
+      << "      return false;\n"
+      << "    }\n"
+      << "    bool success = false;\n"
+      << "    switch (entry->kind) {\n"
+      << "      case BOOL_FLAG:\n"
+      << "        success = (flags.*entry->bool_flag).setValue(tokens);\n"
+      << "        break;\n"
+      << "      case INT32_FLAG:\n"
+      << "        success = (flags.*entry->int32_flag).setValue(tokens);\n"
+      << "        break;\n"
+      << "      case STRING_FLAG:\n"
+      << "        success = (flags.*entry->string_flag).setValue(tokens);\n"
+      << "        break;\n"
+      << "    }\n"
+      << "    if (!success) {\n"
+      << "      return false;\n"
+      << "    }\n"
+      << "  }\n"
+      << "  return true;\n"
+      << "}\n\n";
+
+  out << "struct " << type_name << "Registry {\n"
+      << "  " << type_name << "& flags;\n"
+      << "};\n\n"
+      << "AbstractFlag* find_flag(const " << type_name
+      << "Registry& registry, std::string_view name) {\n"
+      << "  const " << type_name << "Index::Entry* entry =\n"
+      << "      " << type_name << "Index::find(name);\n"
+      << "  if (entry == nullptr) {\n"
+      << "    return nullptr;\n"
+      << "  }\n"
+      << "  switch (entry->kind) {\n"
+      << "    case BOOL_FLAG:\n"
+      << "      return &(registry.flags.*entry->bool_flag);\n"
+      << "    case INT32_FLAG:\n"
+      << "      return &(registry.flags.*entry->int32_flag);\n"
+      << "    case STRING_FLAG:\n"
+      << "      return &(registry.flags.*entry->string_flag);\n"
+      << "  }\n"
+      << "  return nullptr;\n"
+      << "}\n";
+  return true;
+}
+
+// Every allocation made through operator new is counted, so tests can check
+// that a parse does not allocate and benchmarks can report how much it does.
+std::atomic<size_t> allocation_count;
+std::atomic<size_t> allocated_bytes;
+std::atomic<size_t> live_bytes;
+
+// Stored just before each counted allocation, so that counted_free knows its
+// size and where the underlying block starts.
+struct AllocationHeader {
+  size_t size;
+  size_t offset;
+};
+
+void* counted_allocate(size_t size, size_t alignment) {
+  size = std::max<size_t>(size, 1);
+  // The header takes a whole multiple of the alignment, which keeps the
+  // returned pointer aligned.
+  size_t offset = std::max(alignment, (sizeof(AllocationHeader) +
+                                       __STDCPP_DEFAULT_NEW_ALIGNMENT__ - 1) /
+                                          __STDCPP_DEFAULT_NEW_ALIGNMENT__ *
+                                          __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+  char* block;
+  if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+    block = static_cast<char*>(std::malloc(offset + size));
+  } else {
+    block = static_cast<char*>(std::aligned_alloc(
+        alignment, (offset + size + alignment - 1) / alignment * alignment));
+  }
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  char* p = block + offset;
+  AllocationHeader header{size, offset};
+  std::memcpy(p - sizeof(header), &header, sizeof(header));
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  live_bytes.fetch_add(size, std::memory_order_relaxed);
+  return p;
+}
+
+void counted_free(void* p) {
+  if (p == nullptr) {
+    return;
+  }
+  AllocationHeader header;
+  std::memcpy(&header, static_cast<char*>(p) - sizeof(header), sizeof(header));
+  live_bytes.fetch_sub(header.size, std::memory_order_relaxed);
+  std::free(static_cast<char*>(p) - header.offset);
+}
+
+void* operator new(size_t size) { return counted_allocate(size, 0); }
+void* operator new[](size_t size) { return counted_allocate(size, 0); }
+void* operator new(size_t size, std::align_val_t alignment) {
+  return counted_allocate(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return counted_allocate(size, static_cast<size_t>(alignment));
+}
+// std::stable_sort, for one, takes its buffer from the nothrow forms.
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return counted_allocate(size, 0);
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  try {
+    return counted_allocate(size, 0);
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete(void* p, size_t) noexcept { counted_free(p); }
+void operator delete[](void* p, size_t) noexcept { counted_free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  counted_free(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  counted_free(p);
+}
+
+void test_happy() {
+  BoolFlag local;
+  Int32Flag port;
+  StringFlag directory;
+  FlagRegistry registry;
+  registry["l"] = &local;
+  registry["p"] = &port;
+  registry["d"] = &directory;
+  std::string arg_list = "-l -p 1080 -d /hola/mundo";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(success);
+  assert(local.getValue() == true);
+  assert(port.getValue() == 1080);
+  assert(directory.getValue() == "/hola/mundo");
+}
+
+void test_not_in_arg_list() {
+  BoolFlag local;
+  Int32Flag port;
+  StringFlag directory;
+  FlagRegistry registry;
+  registry["l"] = &local;
+  registry["p"] = &port;
+  registry["d"] = &directory;
+  std::string arg_list = "";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(success);
+  assert(local.getValue() == false);
+  assert(port.getValue() == 0);
+  assert(directory.getValue() == "");
+}
+
+void test_not_in_scheme() {
+  FlagRegistry registry;
+  std::string arg_list = "-x";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(!success);
+}
+
+void test_value_starts_with_hyphen() {
+  Int32Flag port;
+  StringFlag directory;
+  FlagRegistry registry;
+  registry["p"] = &port;
+  registry["d"] = &directory;
+  std::string arg_list = "-p -1080 -d -hola_mundo";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(success);
+  assert(port.getValue() == -1080);
+  assert(directory.getValue() == "-hola_mundo");
+}
+
+void test_early_exit() {
+  StringFlag directory;
+  FlagRegistry registry;
+  registry["d"] = &directory;
+  std::string arg_list = "-d";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(!success);
+}
+
+void test_bad_int() {
+  Int32Flag port;
+  FlagRegistry registry;
+  registry["p"] = &port;
+  std::string arg_list = "-p abc";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(!success);
+}
+
+void test_duplicate() {
+  Int32Flag port;
+  FlagRegistry registry;
+  registry["p"] = &port;
+  std::string arg_list = "-p 1080 -p 88";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(success);
+  assert(port.getValue() == 88);
+}
+
+void test_tokenizer_matches_stream() {
+  std::string arg_list = "  -l\t-p  1080\n-d /hola/mundo \r\v\f";
+  std::stringstream stream(arg_list);
+  Tokenizer tokens(arg_list);
+  std::string expected;
+  std::string_view actual;
+
+  while (stream >> expected) {
+    bool found = tokens.next(actual);
+    assert(found);
+    assert(actual == expected);
+  }
+  bool found = tokens.next(actual);
+  assert(!found);
+}
+
+void test_argv() {
+  BoolFlag local;
+  Int32Flag port;
+  StringFlag directory;
+  FlagRegistry registry;
+  registry["l"] = &local;
+  registry["p"] = &port;
+  registry["d"] = &directory;
+  const char* argv[] = {"server", "-l", "-p", "1080", "-d", "/hola mundo"};
+
+  bool success = parse_argv(registry, 6, argv);
+
+  assert(success);
+  assert(local.getValue() == true);
+  assert(port.getValue() == 1080);
+  assert(directory.getValue() == "/hola mundo");
+}
+
+void test_argv_span_has_no_program_name() {
+  Int32Flag port;
+  FlagRegistry registry;
+  registry["p"] = &port;
+  const char* args[] = {"-p", "88"};
+
+  bool success = parse_argv(registry, args);
+
+  assert(success);
+  assert(port.getValue() == 88);
+}
+
+void test_argv_empty() {
+  FlagRegistry registry;
+  const char* argv[] = {"server"};
+
+  bool success = parse_argv(registry, 1, argv);
+  assert(success);
+  success = parse_argv(registry, 0, nullptr);
+  assert(success);
+}
+
+constexpr PerfectHash<3> kServerFlags({"l", "p", "d"});
+static_assert(kServerFlags.find("l") == 0);
+static_assert(kServerFlags.find("p") == 1);
+static_assert(kServerFlags.find("d") == 2);
+static_assert(kServerFlags.find("x") == 3);
+static_assert(kServerFlags.find("") == 3);
+
+using ServerFlagSet =
+    FlagSet<Flag<"l", bool>, Flag<"p", int32_t>, Flag<"d", std::string>>;
+static_assert(ServerFlagSet::indexOf("p") == 1);
+static_assert(ServerFlagSet::kNames.find("d") == 2);
+static_assert(ServerFlagSet::kNames.find("x") == 3);
+
+void test_flag_set() {
+  ServerFlagSet::Values values;
+  std::string arg_list = "-l -p 1080 -d /hola/mundo";
+
+  bool success = parse_arg_list<ServerFlagSet>(arg_list, values);
+
+  assert(success);
+  assert(ServerFlagSet::get<"l">(values) == true);
+  assert(ServerFlagSet::get<"p">(values) == 1080);
+  assert(ServerFlagSet::get<"d">(values) == "/hola/mundo");
+  success = parse_arg_list<ServerFlagSet>("-x", values);
+  assert(!success);
+  success = parse_arg_list<ServerFlagSet>("-p 10x", values);
+  assert(!success);
+  success = parse_arg_list<ServerFlagSet>("-d", values);
+  assert(!success);
+
+  using ViewFlags = FlagSet<Flag<"name", std::string_view>>;
+  ViewFlags::Values views{{"default"}};
+  assert(ViewFlags::get<"name">(views) == "default");
+  std::string input = "-name borrowed";
+  success = parse_arg_list<ViewFlags>(input, views);
+  assert(success);
+  assert(ViewFlags::get<"name">(views) == "borrowed");
+  assert(ViewFlags::get<"name">(views).data() == input.data() + 6);
+  success = parse_arg_list<ViewFlags>("-l", views);
+  assert(!success);
+
+  // Past kMaxLinearSearch flags, names go through the perfect hash.
+  using ManyFlags =
+      FlagSet<Flag<"f0", int32_t>, Flag<"f1", int32_t>, Flag<"f2", int32_t>,
+              Flag<"f3", int32_t>, Flag<"f4", int32_t>, Flag<"f5", int32_t>,
+              Flag<"f6", int32_t>, Flag<"f7", int32_t>, Flag<"f8", int32_t>,
+              Flag<"f9", bool>>;
+  static_assert(ManyFlags::kSize > ManyFlags::kMaxLinearSearch);
+  ManyFlags::Values many;
+  success = parse_arg_list<ManyFlags>("-f9 -f3 3 -f8 8", many);
+  assert(success);
+  assert(ManyFlags::get<"f3">(many) == 3);
+  assert(ManyFlags::get<"f8">(many) == 8);
+  assert(ManyFlags::get<"f9">(many) == true);
+  assert(ManyFlags::get<"f0">(many) == 0);
+  success = parse_arg_list<ManyFlags>("-f10", many);
+  assert(!success);
+  assert(ServerFlagSet::find("p") == 1);
+  assert(ServerFlagSet::find("pp") == 3);
+}
+
+constexpr bool parses_as_int32(std::string_view token, int32_t expected) {
+  int32_t value = 0;
+  return parse_int32(token, value) && value == expected;
+}
+
+static_assert(parses_as_int32("1080", 1080));
+static_assert(parses_as_int32("+7", 7));
+static_assert(parses_as_int32("-2147483648", INT32_MIN));
+static_assert(parses_as_int32("000000000002147483647", INT32_MAX));
+static_assert(!parses_as_int32("2147483648", 0));
+static_assert(!parses_as_int32("", 0));
+static_assert(!parses_as_int32("-", 0));
+static_assert(!parses_as_int32("+-5", 0));
+static_assert(!parses_as_int32("12a", 0));
+
+using PresetFlags =
+    FlagSet<Flag<"l", bool>, Flag<"p", int32_t>, Flag<"d", std::string_view>>;
+constexpr PresetFlags::Values kServerPreset =
+    parse_preset<PresetFlags, "-l -p 1080 -d /hola/mundo">();
+static_assert(PresetFlags::get<"l">(kServerPreset) == true);
+static_assert(PresetFlags::get<"p">(kServerPreset) == 1080);
+static_assert(PresetFlags::get<"d">(kServerPreset) == "/hola/mundo");
+constexpr PresetFlags::Values kEmptyPreset = parse_preset<PresetFlags, "">();
+static_assert(PresetFlags::get<"p">(kEmptyPreset) == 0);
+
+void test_preset_matches_runtime_parse() {
+  PresetFlags::Values values;
+  bool success =
+      parse_arg_list<PresetFlags>("-l -p 1080 -d /hola/mundo", values);
+  assert(success);
+  assert(PresetFlags::get<"l">(values) == PresetFlags::get<"l">(kServerPreset));
+  assert(PresetFlags::get<"p">(values) == PresetFlags::get<"p">(kServerPreset));
+  assert(PresetFlags::get<"d">(values) == PresetFlags::get<"d">(kServerPreset));
+}
+
+void test_static_registry() {
+  BoolFlag local;
+  Int32Flag port;
+  StringFlag directory;
+  StaticFlagRegistry<3> registry{kServerFlags, {&local, &port, &directory}};
+  std::string arg_list = "-l -p 1080 -d /hola/mundo";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(success);
+  assert(local.getValue() == true);
+  assert(port.getValue() == 1080);
+  assert(directory.getValue() == "/hola/mundo");
+  success = parse_arg_list(registry, "-x");
+  assert(!success);
+}
+
+void test_perfect_hash_large() {
+  std::vector<std::string> storage;
+  for (int i = 0; i < 3000; ++i) {
+    storage.push_back("flag_" + std::to_string(i));
+  }
+  auto names = std::make_unique<std::array<std::string_view, 3000>>();
+  for (size_t i = 0; i < storage.size(); ++i) {
+    (*names)[i] = storage[i];
+  }
+  auto hash = std::make_unique<PerfectHash<3000>>(*names);
+
+  for (size_t i = 0; i < storage.size(); ++i) {
+    assert(hash->find(storage[i]) == i);
+  }
+  assert(hash->find("flag_3000") == 3000);
+  assert(hash->find("flag_") == 3000);
+}
+
+void test_flat_registry() {
+  BoolFlag local;
+  Int32Flag port;
+  StringFlag directory;
+  FlatFlagRegistry registry;
+  registry.add("l", &local);
+  registry.add("p", &port);
+  registry.add("d", &directory);
+  std::string arg_list = "-l -p 1080 -d /hola/mundo";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(success);
+  assert(local.getValue() == true);
+  assert(port.getValue() == 1080);
+  assert(directory.getValue() == "/hola/mundo");
+  success = parse_arg_list(registry, "-x");
+  assert(!success);
+}
+
+void test_flat_registry_grows_and_replaces() {
+  std::vector<BoolFlag> flags(1000);
+  FlatFlagRegistry registry;
+  for (size_t i = 0; i < flags.size(); ++i) {
+    registry.add("flag_" + std::to_string(i), &flags[0]);
+  }
+  for (size_t i = 0; i < flags.size(); ++i) {
+    registry.add("flag_" + std::to_string(i), &flags[i]);
+  }
+
+  assert(registry.size() == flags.size());
+  for (size_t i = 0; i < flags.size(); ++i) {
+    assert(registry.find("flag_" + std::to_string(i)) == &flags[i]);
+  }
+  assert(registry.find("flag_1000") == nullptr);
+  assert(FlatFlagRegistry().find("flag_0") == nullptr);
+}
+
+void test_parse_int32() {
+  int32_t value = 7;
+  struct {
+    std::string_view token;
+    int32_t expected;
+  } valid[] = {{"0", 0},
+               {"-1080", -1080},
+               {"+1080", 1080},
+               {"12345678", 12345678},
+               {"2147483647", INT32_MAX},
+               {"-2147483648", INT32_MIN},
+               {"0000000000000000000042", 42},
+               {"-000000000002147483648", INT32_MIN}};
+
+  for (auto [token, expected] : valid) {
+    bool success = parse_int32(token, value);
+    assert(success && value == expected);
+  }
+  value = 7;
+  for (std::string_view token :
+       {"2147483648", "-2147483649", "99999999999", "00000000002147483648",
+        "abc", "1234567a", "1234567/9", "123:", "", "-", "+", "--1", "+-1",
+        "1 "}) {
+    bool success = parse_int32(token, value);
+    assert(!success);
+  }
+  assert(value == 7);
+}
+
+void test_parse_int32_matches_from_chars() {
+  uint32_t bits = 12345;
+  for (int i = 0; i < 100000; ++i) {
+    bits = bits * 1664525 + 1013904223;
+    int32_t expected = static_cast<int32_t>(bits) >> (bits % 31);
+    std::string token = std::to_string(expected);
+    int32_t actual;
+
+    bool success = parse_int32(token, actual);
+    assert(success);
+    assert(actual == expected);
+  }
+}
+
+void test_overflow() {
+  Int32Flag port;
+  FlagRegistry registry;
+  registry["p"] = &port;
+
+  bool success = parse_arg_list(registry, "-p 4294967296");
+  assert(!success);
+  assert(port.getValue() == 0);
+}
+
+class CountingFlag : public AbstractFlag {
+ public:
+  int getValue() { return count_; }
+  bool setValue(Tokenizer&) override {
+    ++count_;
+    return true;
+  }
+
+ private:
+  int count_ = 0;
+};
+
+void test_variant_registry() {
+  CountingFlag verbose;
+  VariantFlags flags;
+  size_t local = flags.add("l", BoolFlag());
+  size_t port = flags.add("p", Int32Flag());
+  size_t directory = flags.add("d", StringFlag());
+  flags.add("v", &verbose);
+  VariantFlagRegistry registry{flags};
+  std::string arg_list = "-l -p 1080 -v -d /hola/mundo -v";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(success);
+  assert(flags.get<BoolFlag>(local).getValue() == true);
+  assert(flags.get<Int32Flag>(port).getValue() == 1080);
+  assert(flags.get<StringFlag>(directory).getValue() == "/hola/mundo");
+  assert(verbose.getValue() == 2);
+  success = parse_arg_list(registry, "-x");
+  assert(!success);
+  success = parse_arg_list(registry, "-p abc");
+  assert(!success);
+}
+
+void test_steady_state_parse_does_not_allocate() {
+  BoolFlag local;
+  Int32Flag port;
+  StringFlag directory;
+  FlagRegistry registry;
+  registry["l"] = &local;
+  registry["p"] = &port;
+  registry["d"] = &directory;
+  FlatFlagRegistry flat_registry;
+  flat_registry.add("l", &local);
+  flat_registry.add("p", &port);
+  flat_registry.add("d", &directory);
+  StaticFlagRegistry<3> static_registry{kServerFlags,
+                                        {&local, &port, &directory}};
+  VariantFlags variant_flags;
+  variant_flags.add("l", BoolFlag());
+  variant_flags.add("p", Int32Flag());
+  variant_flags.add("d", StringFlag());
+  VariantFlagRegistry variant_registry{variant_flags};
+  directory.reserve(64);
+  std::string arg_list = "-l -p 1080 -d /a/path/longer/than/the/small/buffer";
+  const char* argv[] = {"server", "-p", "88", "-d", "/a/shorter/path"};
+  // The first parse sizes the variant registry's StringFlag.
+  bool success = parse_arg_list(variant_registry, arg_list);
+  assert(success);
+
+  size_t allocations = allocation_count.load();
+  success = parse_arg_list(registry, arg_list);
+  assert(success);
+  success = parse_arg_list(flat_registry, arg_list);
+  assert(success);
+  success = parse_arg_list(static_registry, arg_list);
+  assert(success);
+  success = parse_arg_list(variant_registry, arg_list);
+  assert(success);
+  success = parse_argv(registry, 5, argv);
+  assert(success);
+  success = parse_arg_list(registry, "-x");
+  assert(!success);
+  assert(allocation_count.load() == allocations);
+}
+
+void test_schema() {
+  FlagSchema schema;
+  size_t local = schema.addBool("l");
+  size_t port = schema.addInt32("p", 80);
+  size_t directory = schema.addString("d", "/tmp");
+  size_t verbose = schema.addBool("v");
+  FlagValues values = schema.makeValues();
+  FlagValues other = schema.makeValues();
+
+  bool success = parse_arg_list(schema, "-l -p 1080 -d /hola/mundo", values);
+
+  assert(success);
+  assert(values.getBool(local) == true);
+  assert(values.getInt32(port) == 1080);
+  assert(values.getString(directory) == "/hola/mundo");
+  assert(values.getBool(verbose) == false);
+  assert(other.getBool(local) == false);
+  assert(other.getInt32(port) == 80);
+  assert(other.getString(directory) == "/tmp");
+  success = parse_arg_list(schema, "-x", values);
+  assert(!success);
+  success = parse_arg_list(schema, "-p abc", values);
+  assert(!success);
+  success = parse_arg_list(schema, "-d", values);
+  assert(!success);
+
+  schema.reset(values);
+
+  assert(values.getBool(local) == false);
+  assert(values.getInt32(port) == 80);
+  assert(values.getString(directory) == "/tmp");
+}
+
+void test_schema_duplicate_name() {
+  pid_t child = fork();
+  assert(child >= 0);
+  if (child == 0) {
+    FlagSchema schema;
+    schema.addBool("l");
+    schema.addInt32("l");
+    _exit(0);
+  }
+  int status = 0;
+  pid_t waited = waitpid(child, &status, 0);
+  assert(waited == child);
+  assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+
+void test_schema_reset_does_not_allocate() {
+  FlagSchema schema;
+  size_t directory = schema.addString("d");
+  FlagValues values = schema.makeValues();
+  std::string arg_list = "-d /a/path/longer/than/the/small/buffer";
+  bool success = parse_arg_list(schema, arg_list, values);
+  assert(success);
+
+  size_t allocations = allocation_count.load();
+  schema.reset(values);
+  success = parse_arg_list(schema, arg_list, values);
+  assert(success);
+  assert(allocation_count.load() == allocations);
+  assert(values.getString(directory) == "/a/path/longer/than/the/small/buffer");
+}
+
+void test_lazy_values() {
+  FlagSchema schema;
+  size_t local = schema.addBool("l");
+  size_t port = schema.addInt32("p", 80);
+  size_t retries = schema.addInt32("r", 3);
+  size_t timeout = schema.addInt32("t", 10);
+  size_t directory = schema.addString("d", "/tmp");
+  LazyFlagValues values(schema);
+  std::string arg_list = "-l -p 1080 -t abc -d /hola/mundo";
+
+  bool success = parse_arg_list(schema, arg_list, values);
+
+  assert(success);
+  assert(values.getBool(local) == true);
+  assert(values.getInt32(port) == 1080);
+  assert(values.getInt32(port) == 1080);
+  assert(values.getInt32(retries) == 3);
+  assert(values.getString(directory) == "/hola/mundo");
+  assert(!values.validateAll());
+  assert(values.getInt32(timeout) == std::nullopt);
+  success = parse_arg_list(schema, "-x", values);
+  assert(!success);
+  success = parse_arg_list(schema, "-p", values);
+  assert(!success);
+
+  values.reset(schema);
+  success = parse_arg_list(schema, "-t 5", values);
+  assert(success);
+  assert(values.validateAll());
+  assert(values.getInt32(timeout) == 5);
+  assert(values.getInt32(port) == 80);
+}
+
+// Writes `contents` to a file named `name` in the temporary directory and
+// returns its path.
+std::string write_temp_file(const std::string& name,
+                            const std::string& contents) {
+  std::string path = std::filesystem::temp_directory_path() / name;
+  std::ofstream(path) << contents;
+  return path;
+}
+
+void test_flagfile() {
+  std::string nested = write_temp_file("args_nested.flags", "-p 1080\n");
+  std::string main = write_temp_file(
+      "args_main.flags", "-l\n-p 80\n@" + nested + "\n-d /hola/mundo\n");
+  BoolFlag local;
+  Int32Flag port;
+  StringViewFlag directory;
+  FlagRegistry registry;
+  registry["l"] = &local;
+  registry["p"] = &port;
+  registry["d"] = &directory;
+  Flagfiles files;
+
+  bool success = parse_flagfile(registry, main, files);
+
+  assert(success);
+  assert(local.getValue() == true);
+  assert(port.getValue() == 1080);
+  assert(directory.getValue() == "/hola/mundo");
+  std::string empty = write_temp_file("args_empty.flags", "");
+  std::string bad = write_temp_file("args_bad.flags", "-p abc");
+  success = parse_flagfile(registry, empty, files);
+  assert(success);
+  success = parse_flagfile(registry, bad, files);
+  assert(!success);
+  success = parse_flagfile(registry, "/nonexistent/args.flags", files);
+  assert(!success);
+  for (const std::string& path : {nested, main, empty, bad}) {
+    std::filesystem::remove(path);
+  }
+}
+
+void test_flagfile_cycle() {
+  std::string first = std::filesystem::temp_directory_path() / "args_a.flags";
+  std::string second = std::filesystem::temp_directory_path() / "args_b.flags";
+  write_temp_file("args_a.flags", "-p 1 @" + second);
+  write_temp_file("args_b.flags", "-p 2 @" + first);
+  std::string diamond = write_temp_file(
+      "args_diamond.flags",
+      "@" + write_temp_file("args_leaf.flags", "-p 3") + " @" +
+          std::filesystem::temp_directory_path().string() + "/args_leaf.flags");
+  Int32Flag port;
+  FlagRegistry registry;
+  registry["p"] = &port;
+  Flagfiles files;
+
+  bool success = parse_flagfile(registry, first, files);
+  assert(!success);
+  success = parse_flagfile(registry, diamond, files);
+  assert(success);
+  assert(port.getValue() == 3);
+  for (const char* name : {"args_a.flags", "args_b.flags", "args_diamond.flags",
+                           "args_leaf.flags"}) {
+    std::filesystem::remove(std::filesystem::temp_directory_path() / name);
+  }
+}
+
+void test_string_view_flag() {
+  StringViewFlag directory;
+  BoolFlag local;
+  FlagRegistry registry;
+  registry["d"] = &directory;
+  registry["l"] = &local;
+  std::string arg_list = "-d /hola/mundo -l";
+
+  bool success = parse_arg_list(registry, arg_list);
+
+  assert(success);
+  assert(directory.getValue() == "/hola/mundo");
+  assert(directory.getValue().data() == arg_list.data() + 3);
+  success = parse_arg_list(registry, "-d");
+  assert(!success);
+}
+
+void test_values_borrow_strings() {
+  FlagSchema schema;
+  size_t directory = schema.addString("d", "/tmp");
+  FlagValues values = schema.makeValues();
+  values.borrowStrings(true);
+  std::string arg_list = "-d /hola/mundo";
+
+  size_t allocations = allocation_count.load();
+  bool success = parse_arg_list(schema, arg_list, values);
+
+  assert(success);
+  assert(allocation_count.load() == allocations);
+  assert(values.getString(directory) == "/hola/mundo");
+  assert(values.getString(directory).data() == arg_list.data() + 3);
+  FlagValues copy = values;
+  assert(copy.getString(directory).data() == arg_list.data() + 3);
+}
+
+void test_string_arena() {
+  StringArena arena;
+  std::string long_value(StringArena::kChunkSize + 1, 'x');
+
+  std::string_view hola = arena.copy("hola");
+  std::string_view mundo = arena.copy("mundo");
+  std::string_view large = arena.copy(long_value);
+
+  assert(hola == "hola");
+  assert(mundo == "mundo");
+  assert(large == long_value);
+  assert(arena.owns(hola.data()) && arena.owns(large.data()));
+  assert(!arena.owns(long_value.data()));
+  std::string_view empty = arena.copy("");
+  assert(empty.empty());
+
+  size_t allocations = allocation_count.load();
+  arena.reset();
+  std::string_view adios = arena.copy("adios");
+  std::string_view reused = arena.copy(long_value);
+  assert(adios.data() == hola.data());
+  assert(reused.data() == large.data());
+  assert(allocation_count.load() == allocations);
+}
+
+void test_values_copy_owns_its_strings() {
+  FlagSchema schema;
+  size_t directory = schema.addString("d", "/tmp");
+  size_t other = schema.addString("o", "default");
+  FlagValues copy;
+  {
+    FlagValues values = schema.makeValues();
+    bool success = parse_arg_list(schema, "-d /hola/mundo", values);
+    assert(success);
+    copy = values;
+    schema.reset(values);
+    success = parse_arg_list(schema, "-d /adios", values);
+    assert(success);
+  }
+
+  assert(copy.getString(directory) == "/hola/mundo");
+  assert(copy.getString(other) == "default");
+}
+
+void test_parse_batch() {
+  FlagSchema schema;
+  schema.addBool("l");
+  schema.addInt32("p");
+  schema.addString("d");
+  std::vector<std::string> storage;
+  for (int i = 0; i < 5000; ++i) {
+    switch (i % 4) {
+      case 0:
+        storage.push_back("-l -p " + std::to_string(i) + " -d /hola/mundo");
+        break;
+      case 1:
+        storage.push_back("-p " + std::to_string(i) + "x");
+        break;
+      case 2:
+        storage.push_back("-d /" + std::to_string(i) + " -x");
+        break;
+      case 3:
+        storage.push_back("");
+        break;
+    }
+  }
+  std::vector<std::string_view> lines(storage.begin(), storage.end());
+
+  auto check = [&](const std::vector<uint8_t>& results) {
+    for (size_t i = 0; i < lines.size(); ++i) {
+      assert(results[i] == (i % 4 == 0 || i % 4 == 3));
+    }
+  };
+  for (unsigned threads : {1, 2, 7}) {
+    ParsePool pool(threads);
+    // The pool's threads are reused from one batch to the next.
+    for (int batch = 0; batch < 3; ++batch) {
+      std::vector<uint8_t> results(lines.size());
+      pool.parse(schema, lines, results);
+      check(results);
+    }
+    pool.parse(schema, {}, {});
+  }
+  std::vector<uint8_t> results(lines.size());
+  parse_batch(schema, lines, results);
+  check(results);
+}
+
+// Random arg lists over a small alphabet heavy in whitespace, hyphens and
+// digits, many longer than one 64-byte block.
+std::string random_arg_list(uint32_t& bits) {
+  static const char kAlphabet[] = " \t\n\v\f\r--lpd0123456789x/";
+  std::string arg_list;
+  bits = bits * 1664525 + 1013904223;
+  size_t size = bits % 300;
+  for (size_t i = 0; i < size; ++i) {
+    bits = bits * 1664525 + 1013904223;
+    arg_list += kAlphabet[(bits >> 16) % (sizeof(kAlphabet) - 1)];
+  }
+  return arg_list;
+}
+
+void test_whitespace_mask() {
+  uint32_t bits = 7;
+  for (int i = 0; i < 1000; ++i) {
+    char block[64];
+    for (char& c : block) {
+      bits = bits * 1664525 + 1013904223;
+      c = static_cast<char>(bits >> 24);
+    }
+    assert(whitespace_mask(block) == whitespace_mask_scalar(block));
+  }
+}
+
+void test_structural_index_matches_tokenizer() {
+  StructuralIndex index;
+  uint32_t bits = 42;
+  for (int i = 0; i < 2000; ++i) {
+    std::string arg_list = random_arg_list(bits);
+    bool built = index.build(arg_list);
+    assert(built);
+    Tokenizer expected(arg_list);
+    Tokenizer actual(arg_list, index.boundaries());
+    std::string_view expected_token;
+    std::string_view actual_token;
+
+    while (expected.next(expected_token)) {
+      bool found = actual.next(actual_token);
+      assert(found);
+      assert(actual_token == expected_token);
+    }
+    bool found = actual.next(actual_token);
+    assert(!found);
+  }
+}
+
+void test_structural_index_rejects_long_input() {
+  // Address space for an input one byte too long, never touched.
+  size_t size = StructuralIndex::kMaxInputSize + 1;
+  void* data = mmap(nullptr, size, PROT_READ,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  assert(data != MAP_FAILED);
+  StructuralIndex index;
+  bool built = index.build("-l -p 1080");
+  assert(built);
+
+  built = index.build(std::string_view(static_cast<const char*>(data), size));
+  assert(!built);
+  assert(index.boundaries().empty());
+  munmap(data, size);
+}
+
+void test_parse_indexed_matches_parse_arg_list() {
+  FlagSchema schema;
+  size_t local = schema.addBool("l");
+  size_t port = schema.addInt32("p");
+  size_t directory = schema.addString("d");
+  FlagValues expected = schema.makeValues();
+  FlagValues actual = schema.makeValues();
+  StructuralIndex index;
+  uint32_t bits = 1080;
+  for (int i = 0; i < 2000; ++i) {
+    std::string arg_list = random_arg_list(bits);
+
+    bool success = parse_arg_list(schema, arg_list, expected);
+
+    bool indexed =
+        parse_indexed(SchemaRegistry{schema, actual}, arg_list, index);
+    assert(indexed == success);
+    assert(actual.getBool(local) == expected.getBool(local));
+    assert(actual.getInt32(port) == expected.getInt32(port));
+    assert(actual.getString(directory) == expected.getString(directory));
+  }
+}
+
+void test_two_phase() {
+  FlagSchema schema;
+  size_t local = schema.addBool("l");
+  size_t port = schema.addInt32("p");
+  size_t directory = schema.addString("d");
+  FlagValues values = schema.makeValues();
+  PendingValues pending;
+
+  bool success =
+      parse_two_phase(schema, "-p 1 -l -d /a -p 1080 -d /hola/mundo", values,
+                      pending);
+
+  assert(success);
+  assert(values.getBool(local) == true);
+  assert(values.getInt32(port) == 1080);
+  assert(values.getString(directory) == "/hola/mundo");
+  success = parse_two_phase(schema, "-p abc", values, pending);
+  assert(!success);
+  success = parse_two_phase(schema, "-d", values, pending);
+  assert(!success);
+  success = parse_two_phase(schema, "-x", values, pending);
+  assert(!success);
+  success = parse_two_phase(schema, "p 1", values, pending);
+  assert(!success);
+}
+
+void test_two_phase_matches_parse_arg_list() {
+  FlagSchema schema;
+  size_t local = schema.addBool("l");
+  size_t port = schema.addInt32("p");
+  size_t directory = schema.addString("d");
+  FlagValues expected = schema.makeValues();
+  FlagValues actual = schema.makeValues();
+  PendingValues pending;
+  uint32_t bits = 88;
+  for (int i = 0; i < 2000; ++i) {
+    std::string arg_list = random_arg_list(bits);
+    schema.reset(expected);
+    schema.reset(actual);
+
+    bool success = parse_arg_list(schema, arg_list, expected);
+
+    bool two_phase = parse_two_phase(schema, arg_list, actual, pending);
+    assert(two_phase == success);
+    if (success) {
+      assert(actual.getBool(local) == expected.getBool(local));
+      assert(actual.getInt32(port) == expected.getInt32(port));
+      assert(actual.getString(directory) == expected.getString(directory));
+    }
+  }
+}
+
+// Feeds `arg_list` to a StreamParser in chunks of `chunk_size` bytes.
+template <typename Registry>
+bool parse_in_chunks(const Registry& registry, std::string_view arg_list,
+                     size_t chunk_size) {
+  StreamParser<Registry> parser(registry);
+  for (size_t i = 0; i < arg_list.size(); i += chunk_size) {
+    if (!parser.feed(arg_list.substr(i, chunk_size))) {
+      return false;
+    }
+  }
+  return parser.finish();
+}
+
+void test_stream_parser() {
+  std::string arg_list = "-l  -p 1080\n-d /hola/mundo";
+  for (size_t chunk_size = 1; chunk_size <= arg_list.size(); ++chunk_size) {
+    BoolFlag local;
+    Int32Flag port;
+    StringFlag directory;
+    FlagRegistry registry;
+    registry["l"] = &local;
+    registry["p"] = &port;
+    registry["d"] = &directory;
+
+    bool success = parse_in_chunks(registry, arg_list, chunk_size);
+
+    assert(success);
+    assert(local.getValue() == true);
+    assert(port.getValue() == 1080);
+    assert(directory.getValue() == "/hola/mundo");
+  }
+}
+
+void test_stream_parser_matches_parse_arg_list() {
+  FlagSchema schema;
+  size_t local = schema.addBool("l");
+  size_t port = schema.addInt32("p");
+  size_t directory = schema.addString("d");
+  FlagValues expected = schema.makeValues();
+  FlagValues actual = schema.makeValues();
+  uint32_t bits = 17;
+  for (int i = 0; i < 2000; ++i) {
+    std::string arg_list = random_arg_list(bits);
+    schema.reset(expected);
+    schema.reset(actual);
+
+    bool success = parse_arg_list(schema, arg_list, expected);
+
+    bool chunked = parse_in_chunks(SchemaRegistry<FlagValues>{schema, actual},
+                                   arg_list, 1 + bits % 7);
+    assert(chunked == success);
+    if (success) {
+      assert(actual.getBool(local) == expected.getBool(local));
+      assert(actual.getInt32(port) == expected.getInt32(port));
+      assert(actual.getString(directory) == expected.getString(directory));
+    }
+  }
+}
+
+void test_stream_parser_memory_stays_flat() {
+  FlagSchema schema;
+  size_t directory = schema.addString("d");
+  FlagValues values = schema.makeValues();
+  SchemaRegistry<FlagValues> registry{schema, values};
+  StreamParser<SchemaRegistry<FlagValues>> parser(registry);
+  std::string chunk;
+  for (int i = 0; i < 100; ++i) {
+    chunk += "-d /" + std::string(i % 10 + 1, 'x') + " ";
+  }
+  bool success = parser.feed(chunk);
+  assert(success);
+
+  size_t heap = live_bytes.load();
+  for (int i = 0; i < 10000; ++i) {
+    success = parser.feed(chunk);
+    assert(success);
+  }
+  success = parser.finish();
+  assert(success);
+  assert(live_bytes.load() == heap);
+  assert(values.getString(directory) == "/xxxxxxxxxx");
+}
+
+void test_stream_parser_errors() {
+  Int32Flag port;
+  FlagRegistry registry;
+  registry["p"] = &port;
+
+  bool success = parse_in_chunks(registry, "-p", 1);
+  assert(!success);
+  success = parse_in_chunks(registry, "-p 1 -x 2", 3);
+  assert(!success);
+  success = parse_in_chunks(registry, "-p abc -p 2", 2);
+  assert(!success);
+  assert(port.getValue() == 1);
+  std::string huge =
+      "-p " + std::string(StreamParser<FlagRegistry>::kMaxTokenSize + 1, '1');
+  success = parse_in_chunks(registry, huge, 100);
+  assert(!success);
+
+  StreamParser<FlagRegistry> parser(registry);
+  success = parser.feed("-x ");
+  assert(!success);
+  success = parser.feed("-p 1 ");
+  assert(!success);
+  success = parser.finish();
+  assert(!success);
+}
+
+void test_atomic_flags() {
+  static_assert(alignof(AtomicBoolFlag) == 64);
+  static_assert(alignof(AtomicInt32Flag) == 64);
+  AtomicBoolFlag local;
+  AtomicInt32Flag port;
+  FlagRegistry registry;
+  registry["l"] = &local;
+  registry["p"] = &port;
+
+  bool success = parse_arg_list(registry, "-l -p 1080");
+  assert(success);
+  assert(local.getValue() == true);
+  assert(port.getValue() == 1080);
+  success = parse_arg_list(registry, "-p 99999999999");
+  assert(!success);
+  assert(port.getValue() == 1080);
+  local.reset();
+  assert(local.getValue() == false);
+  success = parse_arg_list(registry, "-p 1080");
+  assert(success);
+  assert(local.getValue() == false);
+
+  std::atomic<bool> stop{false};
+  std::thread reader([&] {
+    int32_t last = 0;
+    while (!stop.load(std::memory_order_relaxed)) {
+      int32_t value = port.getValue();
+      assert(value >= last);
+      last = value;
+    }
+  });
+  for (int i = 1081; i < 20000; ++i) {
+    success = parse_arg_list(registry, "-p " + std::to_string(i));
+    assert(success);
+  }
+  stop = true;
+  reader.join();
+  assert(port.getValue() == 19999);
+}
+
+// Two readers of one pipe both wake up when it becomes readable, but only
+// one finds bytes; the other must keep waiting rather than see end of input.
+void test_parse_async_spurious_wakeup() {
+  FlagSchema schema;
+  size_t port = schema.addInt32("p");
+  EventLoop loop;
+  int fds[2];
+  int created = pipe(fds);
+  assert(created == 0);
+  PipeByteSource first_source(fds[0], loop);
+  PipeByteSource second_source(fds[0], loop);
+  FlagValues first_values = schema.makeValues();
+  FlagValues second_values = schema.makeValues();
+  Task<bool> first = parse_async(schema, first_values, first_source);
+  Task<bool> second = parse_async(schema, second_values, second_source);
+  first.start();
+  second.start();
+
+  ssize_t written = write(fds[1], "-p 1", 4);
+  assert(written == 4);
+  while (loop.runOnce(0)) {
+  }
+  assert(!first.done());
+  assert(!second.done());
+
+  close(fds[1]);
+  loop.run();
+  assert(first.done() && second.done());
+  // Whichever parse read "-p 1" succeeded; the other read nothing at all.
+  assert(first.result() && second.result());
+  assert(first_values.getInt32(port) + second_values.getInt32(port) == 1);
+  close(fds[0]);
+}
+
+void test_config_store() {
+  FlagSchema schema;
+  size_t port = schema.addInt32("p", 80);
+  size_t directory = schema.addString("d", "/");
+  ConfigStore store(schema);
+  ConfigStore::Reader reader(store);
+  {
+    ConfigStore::ReadGuard snapshot = reader.read();
+    assert(snapshot->version == 0);
+    assert(snapshot->values.getInt32(port) == 80);
+    bool reloaded = store.reload("-p 1 -d /1");
+    assert(reloaded);
+    // The old snapshot stays readable until the guard goes away.
+    assert(snapshot->values.getInt32(port) == 80);
+    assert(store.retiredCount() == 1);
+  }
+  bool reloaded = store.reload("-p x");
+  assert(!reloaded);
+  reloaded = store.reload("-d /2");
+  assert(reloaded);
+  assert(store.retiredCount() == 0);
+  ConfigStore::ReadGuard snapshot = reader.read();
+  assert(snapshot->version == 2);
+  assert(snapshot->values.getInt32(port) == 80);
+  assert(snapshot->values.getString(directory) == "/2");
+}
+
+void test_config_store_stress() {
+  FlagSchema schema;
+  size_t port = schema.addInt32("p");
+  size_t directory = schema.addString("d", "/0");
+  ConfigStore store(schema);
+  std::atomic<bool> stop{false};
+  auto read = [&] {
+    ConfigStore::Reader reader(store);
+    uint64_t last_version = 0;
+    std::string expected;
+    while (!stop.load(std::memory_order_relaxed)) {
+      ConfigStore::ReadGuard snapshot = reader.read();
+      assert(snapshot->version >= last_version);
+      last_version = snapshot->version;
+      // Every reload sets both flags, so they must agree.
+      expected = "/" + std::to_string(snapshot->values.getInt32(port));
+      assert(snapshot->values.getString(directory) == expected);
+    }
+  };
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back(read);
+  }
+  for (int i = 1; i <= 5000; ++i) {
+    std::string arg_list =
+        "-p " + std::to_string(i) + " -d /" + std::to_string(i);
+    bool reloaded = store.reload(arg_list);
+    assert(reloaded);
+  }
+  stop = true;
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  bool reloaded = store.reload("-p 0 -d /0");
+  assert(reloaded);
+  assert(store.retiredCount() == 0);
+}
+
+void test_parse_async() {
+  const int kParses = 200;
+  FlagSchema schema;
+  size_t local = schema.addBool("l");
+  size_t port = schema.addInt32("p");
+  size_t directory = schema.addString("d");
+  EventLoop loop;
+  std::vector<std::array<int, 2>> pipes(kParses);
+  std::vector<std::unique_ptr<PipeByteSource>> sources;
+  std::vector<FlagValues> values(kParses, schema.makeValues());
+  std::vector<Task<bool>> parses;
+  for (int i = 0; i < kParses; ++i) {
+    int created = pipe(pipes[i].data());
+    assert(created == 0);
+    sources.push_back(std::make_unique<PipeByteSource>(pipes[i][0], loop));
+    parses.push_back(parse_async(schema, values[i], *sources[i]));
+  }
+
+  // Every parse suspends on its empty pipe, then again half way through.
+  for (int i = 0; i < kParses; ++i) {
+    parses[i].start();
+    assert(!parses[i].done());
+    std::string first = "-l -p " + std::to_string(i) + "0";
+    ssize_t written = write(pipes[i][1], first.data(), first.size());
+    assert(written == static_cast<ssize_t>(first.size()));
+  }
+  while (loop.runOnce(0)) {
+  }
+  for (int i = 0; i < kParses; ++i) {
+    assert(!parses[i].done());
+    std::string second = i % 10 == 9 ? "x" : "8 -d /hola/mundo";
+    ssize_t written = write(pipes[i][1], second.data(), second.size());
+    assert(written == static_cast<ssize_t>(second.size()));
+    close(pipes[i][1]);
+  }
+  loop.run();
+
+  for (int i = 0; i < kParses; ++i) {
+    assert(parses[i].done());
+    assert(parses[i].result() == (i % 10 != 9));
+    if (i % 10 != 9) {
+      assert(values[i].getBool(local) == true);
+      assert(values[i].getInt32(port) == i * 100 + 8);
+      assert(values[i].getString(directory) == "/hola/mundo");
+    }
+    close(pipes[i][0]);
+  }
+
+  // A block that borrows its strings would keep views into reused chunks.
+  int fds[2];
+  int created = pipe(fds);
+  assert(created == 0);
+  PipeByteSource source(fds[0], loop);
+  FlagValues borrowing = schema.makeValues();
+  borrowing.borrowStrings(true);
+  Task<bool> parse = parse_async(schema, borrowing, source);
+  parse.start();
+  assert(parse.done() && !parse.result());
+  close(fds[0]);
+  close(fds[1]);
+}
+
+void test_snapshot() {
+  FlagSchema schema;
+  size_t local = schema.addBool("l");
+  size_t port = schema.addInt32("p", 80);
+  size_t directory = schema.addString("d", "/");
+  size_t user = schema.addString("u", "nobody");
+  std::string flagfile =
+      write_temp_file("args_snapshot.flags", "-l -p 1080\n-d /hola/mundo\n");
+  std::string path = write_temp_file("args.snapshot", "");
+
+  bool written = write_snapshot(schema, flagfile, path);
+  assert(written);
+  FlagSnapshot snapshot;
+  bool loaded = snapshot.load(schema, path, flagfile);
+  assert(loaded);
+  assert(snapshot.mapped());
+  assert(snapshot.getBool(local) == true);
+  assert(snapshot.getInt32(port) == 1080);
+  assert(snapshot.getString(directory) == "/hola/mundo");
+  assert(snapshot.getString(user) == "nobody");
+
+  // A schema that differs in a default does not accept the snapshot, and
+  // the flagfile is parsed instead.
+  FlagSchema changed;
+  changed.addBool("l");
+  changed.addInt32("p", 81);
+  changed.addString("d", "/");
+  changed.addString("u", "nobody");
+  assert(changed.hash() != schema.hash());
+  FlagSnapshot fallback;
+  loaded = fallback.load(changed, path, flagfile);
+  assert(!loaded);
+  loaded = fallback.loadOrParse(changed, path, flagfile);
+  assert(loaded);
+  assert(!fallback.mapped());
+  assert(fallback.getInt32(port) == 1080);
+  assert(fallback.getString(directory) == "/hola/mundo");
+
+  std::string image;
+  bool parsed = parse_snapshot(schema, flagfile, image);
+  assert(parsed);
+  std::string truncated = write_temp_file("args_truncated.snapshot",
+                                          image.substr(0, image.size() - 1));
+  loaded = snapshot.load(schema, truncated, flagfile);
+  assert(!loaded);
+  loaded = snapshot.load(schema, path + ".missing", flagfile);
+  assert(!loaded);
+  // A failed load leaves the previous values in place.
+  assert(snapshot.getString(directory) == "/hola/mundo");
+  std::string corrupt = image;
+  corrupt[sizeof(SnapshotHeader) + sizeof(int32_t)] = 100;
+  std::string corrupt_path = write_temp_file("args_corrupt.snapshot", corrupt);
+  loaded = snapshot.load(schema, corrupt_path, flagfile);
+  assert(!loaded);
+
+  // Editing the flagfile makes the snapshot stale, with the same schema.
+  write_temp_file("args_snapshot.flags", "-p 1081\n");
+  loaded = snapshot.load(schema, path, flagfile);
+  assert(!loaded);
+  loaded = snapshot.loadOrParse(schema, path, flagfile);
+  assert(loaded);
+  assert(!snapshot.mapped());
+  assert(snapshot.getInt32(port) == 1081);
+  assert(snapshot.getString(directory) == "/");
+}
+
+void test_shared_segment() {
+  FlagSchema schema;
+  size_t local = schema.addBool("l");
+  size_t port = schema.addInt32("p", 80);
+  size_t directory = schema.addString("d", "/80");
+  std::string name = "/args_test_" + std::to_string(getpid());
+  SharedFlagSegment primary;
+  bool success = primary.create(name, schema, 64);
+  assert(success);
+  assert(primary.generation() == 1);
+
+  FlagSchema other;
+  other.addInt32("p", 80);
+  SharedFlagSegment sidecar;
+  success = sidecar.open(name, other);
+  assert(!success);
+  success = sidecar.open(name + "_missing", schema);
+  assert(!success);
+  success = sidecar.open(name, schema);
+  assert(success);
+  assert(sidecar.getInt32(port) == 80);
+  assert(sidecar.getString(directory) == "/80");
+
+  FlagValues values = schema.makeValues();
+  success = parse_arg_list(schema, "-d " + std::string(65, 'x'), values);
+  assert(success);
+  success = primary.publish(values);
+  assert(!success);
+  // A sidecar's read-only mapping cannot be published to.
+  success = sidecar.publish(schema.makeValues());
+  assert(!success);
+
+  // A sidecar process checks that every version it reads is whole: the
+  // directory always names the port, and generations never go back.
+  const int kPublishes = 20000;
+  pid_t child = fork();
+  assert(child >= 0);
+  if (child == 0) {
+    SharedFlagSegment segment;
+    if (!segment.open(name, schema)) {
+      _exit(1);
+    }
+    int32_t last = 0;
+    while (last < kPublishes) {
+      int32_t value = 0;
+      bool consistent = true;
+      segment.read([&](const SharedFlagView& view) {
+        value = view.getInt32(port);
+        consistent = view.getString(directory) == "/" + std::to_string(value);
+      });
+      if (!consistent || (value != 80 && value < last)) {
+        _exit(2);
+      }
+      last = value == 80 ? last : value;
+    }
+    _exit(segment.getBool(local) ? 0 : 3);
+  }
+  for (int i = 1; i <= kPublishes; ++i) {
+    std::string arg_list = "-p " + std::to_string(i) + " -d /" +
+                           std::to_string(i) + (i == kPublishes ? " -l" : "");
+    values = schema.makeValues();
+    success = parse_arg_list(schema, arg_list, values);
+    assert(success);
+    success = primary.publish(values);
+    assert(success);
+  }
+  int status = 0;
+  pid_t waited = waitpid(child, &status, 0);
+  assert(waited == child);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(primary.generation() == kPublishes + 1);
+  SharedFlagSegment::remove(name);
+  success = sidecar.open(name, schema);
+  assert(!success);
+}
+
+void test_build_perfect_hash() {
+  std::vector<std::string> storage;
+  std::vector<std::string_view> names;
+  for (size_t i = 0; i < 1000; ++i) {
+    storage.push_back("flag_" + std::to_string(i));
+  }
+  names.assign(storage.begin(), storage.end());
+  PerfectHashTables tables;
+  bool success = build_perfect_hash(names, tables);
+  assert(success);
+  std::vector<bool> found(names.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    uint64_t h = hash_name(names[i]);
+    size_t slot = tables.slot(h, tables.displacements[tables.bucket(h)]);
+    assert(tables.slots[slot] == i);
+  }
+
+  names.push_back("flag_7");
+  success = build_perfect_hash(names, tables);
+  assert(!success);
+}
+
+void test_generate_parser() {
+  std::ostringstream out;
+  std::ostringstream errors;
+  bool success = generate_parser("# Server flags\n"
+                                 "l bool\n"
+                                 "\n"
+                                 "p int32 +0080\n"
+                                 "d string \"/hola\\mundo\"\n",
+                                 "ServerFlags", out, errors);
+  assert(success);
+  std::string code = out.str();
+  assert(code.find("struct ServerFlags {\n"
+                   "  BoolFlag l;\n"
+                   "  Int32Flag p{80};\n"
+                   "  StringFlag d{\"\\\"/hola\\\\mundo\\\"\"};\n"
+                   "};\n") != std::string::npos);
+  assert(code.find("{\"p\", INT32_FLAG, nullptr, &ServerFlags::p, nullptr},") !=
+         std::string::npos);
+  assert(errors.str().empty());
+
+  for (std::string_view schema :
+       {"l", "l bool true", "p int32 1x", "p float", "2p bool",
+        "l bool\nl int32", "d string a b", "class int32", "and bool"}) {
+    std::ostringstream ignored;
+    bool generated = generate_parser(schema, "ServerFlags", ignored, errors);
+    assert(!generated);
+  }
+  for (std::string_view type_name : {"", "2Flags", "Server-Flags", "int"}) {
+    std::ostringstream ignored;
+    bool generated = generate_parser("l bool", type_name, ignored, errors);
+    assert(!generated);
+  }
+}
+
+// Keeps the optimizer from discarding benchmarked work.
+volatile size_t benchmark_sink;
+
+struct BenchmarkResult {
+  std::string name;
+  double ns_per_op;
+  double tokens_per_sec;
+  double bytes_per_sec;
+  // Heap allocations made by one operation after warmup.
+  size_t allocations_per_op;
+  size_t allocated_bytes_per_op;
+  // Scenario-specific figures, such as the memory a registry takes.
+  std::vector<std::pair<std::string, double>> counters;
+};
+
+// Times operations that each handle a known number of tokens and bytes. Each
+// benchmark is calibrated until one repetition takes at least kMinTime, which
+// also warms it up, and reports the median of kRepetitions repetitions.
+class BenchmarkRunner {
+ public:
+  static constexpr int kRepetitions = 5;
+  static constexpr std::chrono::milliseconds kMinTime{10};
+
+  template <typename Op>
+  BenchmarkResult& run(std::string name, size_t tokens, size_t bytes, Op op) {
+    size_t iterations = 1;
+    while (time(op, iterations) < kMinTime) {
+      iterations *= 2;
+    }
+    std::array<double, kRepetitions> ns_per_op;
+    for (double& ns : ns_per_op) {
+      ns = time(op, iterations).count() / iterations;
+    }
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+    double ns = ns_per_op[kRepetitions / 2];
+    size_t allocations = allocation_count.load();
+    size_t allocation_bytes = allocated_bytes.load();
+    benchmark_sink = benchmark_sink + static_cast<size_t>(op());
+    results_.push_back({std::move(name), ns, tokens * 1e9 / ns,
+                        bytes * 1e9 / ns, allocation_count.load() - allocations,
+                        allocated_bytes.load() - allocation_bytes, {}});
+    return results_.back();
+  }
+
+  void print(std::ostream& out) const {
+    for (const BenchmarkResult& result : results_) {
+      out << result.name << " " << result.ns_per_op << " ns/op "
+          << result.tokens_per_sec << " tokens/s " << result.bytes_per_sec
+          << " bytes/s " << result.allocations_per_op << " allocs/op "
+          << result.allocated_bytes_per_op << " allocated_bytes/op";
+      for (const auto& [counter, value] : result.counters) {
+        out << " " << value << " " << counter;
+      }
+      out << std::endl;
+    }
+  }
+
+  void printJson(std::ostream& out) const {
+    out << "{\"repetitions\": " << kRepetitions << ", \"benchmarks\": [";
+    for (size_t i = 0; i < results_.size(); ++i) {
+      const BenchmarkResult& result = results_[i];
+      out << (i == 0 ? "\n" : ",\n") << "  {\"name\": \"" << result.name
+          << "\", \"ns_per_op\": " << result.ns_per_op
+          << ", \"tokens_per_sec\": " << result.tokens_per_sec
+          << ", \"bytes_per_sec\": " << result.bytes_per_sec
+          << ", \"allocations_per_op\": " << result.allocations_per_op
+          << ", \"allocated_bytes_per_op\": " << result.allocated_bytes_per_op;
+      for (const auto& [counter, value] : result.counters) {
+        out << ", \"" << counter << "\": " << value;
+      }
+      out << "}";
+    }
+    out << "\n]}" << std::endl;
+  }
+
+ private:
+  template <typename Op>
+  static std::chrono::duration<double, std::nano> time(Op& op,
+                                                       size_t iterations) {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+      benchmark_sink = benchmark_sink + static_cast<size_t>(op());
+    }
+    return std::chrono::steady_clock::now() - start;
+  }
+
+  std::vector<BenchmarkResult> results_;
+};
+
+size_t count_tokens(std::string_view arg_list) {
+  Tokenizer tokens(arg_list);
+  std::string_view token;
+  size_t count = 0;
+  while (tokens.next(token)) {
+    ++count;
+  }
+  return count;
+}
+
+void bench_tokenizer(BenchmarkRunner& runner) {
+  std::string arg_list;
+  for (int i = 0; i < 100; ++i) {
+    arg_list += "-l -p 1080 -d /hola/mundo ";
+  }
+  size_t tokens = count_tokens(arg_list);
+
+  runner.run("tokenizer/stringstream", tokens, arg_list.size(), [&] {
+    std::stringstream stream(arg_list);
+    std::string token;
+    size_t n = 0;
+    while (stream >> token) {
+      ++n;
+    }
+    return n;
+  });
+  runner.run("tokenizer/string_view", tokens, arg_list.size(),
+             [&] { return count_tokens(arg_list); });
+}
+
+// Tokenizes a multi-megabyte response file byte by byte and through a
+// StructuralIndex.
+void bench_structural_index(BenchmarkRunner& runner) {
+  std::string arg_list;
+  for (int i = 0; arg_list.size() < (4 << 20); ++i) {
+    arg_list += "-d /srv/jobs/" + std::to_string(i) + "/config   -p " +
+                std::to_string(i) + "\n";
+  }
+  size_t tokens = count_tokens(arg_list);
+  StructuralIndex index;
+
+  runner.run("long_input/tokenizer", tokens, arg_list.size(),
+             [&] { return count_tokens(arg_list); });
+  runner.run("long_input/structural_index", tokens, arg_list.size(), [&] {
+    if (!index.build(arg_list)) {
+      return size_t{0};
+    }
+    Tokenizer tokens(arg_list, index.boundaries());
+    std::string_view token;
+    size_t count = 0;
+    while (tokens.next(token)) {
+      ++count;
+    }
+    return count;
+  });
+}
+
+// Parses a 256 MB generated flagfile.
+void bench_flagfile(BenchmarkRunner& runner) {
+  StringViewFlag directory;
+  Int32Flag port;
+  BoolFlag local;
+  FlagRegistry registry;
+  registry["d"] = &directory;
+  registry["p"] = &port;
+  registry["l"] = &local;
+  std::string path =
+      std::filesystem::temp_directory_path() / "args_bench.flags";
+  size_t tokens = 0;
+  size_t bytes = 0;
+  {
+    std::ofstream out(path);
+    std::string chunk;
+    for (int i = 0; i < 10000; ++i) {
+      chunk += "-d /srv/jobs/" + std::to_string(i) + "/config -p " +
+               std::to_string(i) + " -l\n";
+    }
+    size_t chunk_tokens = count_tokens(chunk);
+    while (bytes < (256 << 20)) {
+      out << chunk;
+      bytes += chunk.size();
+      tokens += chunk_tokens;
+    }
+  }
+
+  runner.run("flagfile/256MB", tokens, bytes, [&] {
+    Flagfiles files;
+    return parse_flagfile(registry, path, files);
+  });
+  std::filesystem::remove(path);
+}
+
+// Converts a corpus of numbers of mixed lengths and signs.
+void bench_int32(BenchmarkRunner& runner) {
+  std::vector<std::string> corpus;
+  size_t bytes = 0;
+  uint32_t bits = 12345;
+  for (int i = 0; i < 4096; ++i) {
+    bits = bits * 1664525 + 1013904223;
+    corpus.push_back(std::to_string(static_cast<int32_t>(bits) >> (bits % 31)));
+    bytes += corpus.back().size();
+  }
+
+  runner.run("int32/stringstream", corpus.size(), bytes, [&] {
+    uint32_t sum = 0;
+    for (const std::string& token : corpus) {
+      std::stringstream tokens(token);
+      int32_t value = 0;
+      tokens >> value;
+      sum += value;
+    }
+    return sum;
+  });
+  runner.run("int32/from_chars", corpus.size(), bytes, [&] {
+    uint32_t sum = 0;
+    for (const std::string& token : corpus) {
+      int32_t value = 0;
+      std::from_chars(token.data(), token.data() + token.size(), value);
+      sum += value;
+    }
+    return sum;
+  });
+  runner.run("int32/parse_int32", corpus.size(), bytes, [&] {
+    uint32_t sum = 0;
+    for (const std::string& token : corpus) {
+      int32_t value = 0;
+      parse_int32(token, value);
+      sum += value;
+    }
+    return sum;
+  });
+}
+
+// Flags named flag_0, flag_1, ... whose kinds cycle through bool, int32 and
+// string, registered in a FlagRegistry.
+struct MixedFlags {
+  explicit MixedFlags(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      switch (i % 3) {
+        case 0:
+          flags.push_back(std::make_unique<BoolFlag>());
+          break;
+        case 1:
+          flags.push_back(std::make_unique<Int32Flag>());
+          break;
+        case 2:
+          flags.push_back(std::make_unique<StringFlag>());
+          break;
+      }
+      registry[name(i)] = flags.back().get();
+    }
+  }
+
+  static std::string name(size_t i) { return "flag_" + std::to_string(i); }
+
+  // Returns a valid "-flag_i value" pair for the i-th flag.
+  static std::string arg(size_t i) {
+    switch (i % 3) {
+      case 0:
+        return "-" + name(i) + " ";
+      case 1:
+        return "-" + name(i) + " " + std::to_string(i * 37) + " ";
+      default:
+        return "-" + name(i) + " /hola/mundo ";
+    }
+  }
+
+  std::vector<std::unique_ptr<AbstractFlag>> flags;
+  FlagRegistry registry;
+};
+
+template <typename Registry>
+void bench_parse(BenchmarkRunner& runner, std::string name,
+                 const Registry& registry, const std::string& arg_list) {
+  runner.run(std::move(name), count_tokens(arg_list), arg_list.size(),
+             [&] { return parse_arg_list(registry, arg_list); });
+}
+
+void bench_scenarios(BenchmarkRunner& runner) {
+  {
+    BoolFlag local;
+    Int32Flag port;
+    StringFlag directory;
+    FlagRegistry registry;
+    registry["l"] = &local;
+    registry["p"] = &port;
+    registry["d"] = &directory;
+    bench_parse(runner, "parse/tiny", registry, "-l -p 1080 -d /hola/mundo");
+
+    ServerFlagSet::Values values;
+    bench_parse(runner, "parse/tiny/flag_set",
+                FlagSetRegistry<ServerFlagSet>{values},
+                "-l -p 1080 -d /hola/mundo");
+  }
+  {
+    MixedFlags flags(500);
+    std::string arg_list;
+    for (size_t i = 0; i < 500; ++i) {
+      arg_list += MixedFlags::arg((i * 7919) % 500);
+    }
+    bench_parse(runner, "parse/long_line", flags.registry, arg_list);
+  }
+  for (size_t size : {10, 1000, 100000}) {
+    MixedFlags flags(size);
+    std::string arg_list;
+    for (size_t i = 0; i < 10; ++i) {
+      arg_list += MixedFlags::arg((i * 7919) % size);
+    }
+    bench_parse(runner, "parse/registry_size/" + std::to_string(size),
+                flags.registry, arg_list);
+  }
+  {
+    std::vector<StringFlag> flags(200);
+    FlagRegistry registry;
+    std::string arg_list;
+    for (size_t i = 0; i < flags.size(); ++i) {
+      registry["path_" + std::to_string(i)] = &flags[i];
+      arg_list += "-path_" + std::to_string(i) + " /srv/jobs/" +
+                  std::string(20 + i % 40, 'a' + i % 26) + "/config ";
+    }
+    bench_parse(runner, "parse/string_heavy", registry, arg_list);
+
+    std::vector<StringViewFlag> views(flags.size());
+    for (size_t i = 0; i < views.size(); ++i) {
+      registry["path_" + std::to_string(i)] = &views[i];
+    }
+    bench_parse(runner, "parse/string_heavy/string_view", registry, arg_list);
+  }
+  {
+    // Half of the lines fail: on an unknown flag, a bad number or a missing
+    // value, at varying depths into the line.
+    MixedFlags flags(30);
+    std::vector<std::string> lines;
+    size_t tokens = 0;
+    size_t bytes = 0;
+    for (size_t line = 0; line < 100; ++line) {
+      std::string arg_list;
+      for (size_t i = 0; i < line % 20; ++i) {
+        arg_list += MixedFlags::arg((line + i) % 30);
+      }
+      switch (line % 6) {
+        case 1:
+          arg_list += "-unknown ";
+          break;
+        case 3:
+          arg_list += "-flag_1 abc ";
+          break;
+        case 5:
+          arg_list += "-flag_2";
+          break;
+      }
+      tokens += count_tokens(arg_list);
+      bytes += arg_list.size();
+      lines.push_back(std::move(arg_list));
+    }
+    runner.run("parse/error_heavy", tokens, bytes, [&] {
+      size_t failures = 0;
+      for (const std::string& arg_list : lines) {
+        failures += !parse_arg_list(flags.registry, arg_list);
+      }
+      return failures;
+    });
+  }
+}
+
+// Startup cost of a worker that reads 3000 flags from a flagfile, parsed or
+// loaded from the snapshot of that parse.
+void bench_snapshot(BenchmarkRunner& runner) {
+  const size_t kFlags = 3000;
+  FlagSchema schema;
+  for (size_t i = 0; i < kFlags; ++i) {
+    switch (i % 3) {
+      case 0:
+        schema.addBool(MixedFlags::name(i));
+        break;
+      case 1:
+        schema.addInt32(MixedFlags::name(i));
+        break;
+      case 2:
+        schema.addString(MixedFlags::name(i));
+        break;
+    }
+  }
+  std::filesystem::path directory = std::filesystem::temp_directory_path();
+  std::string flagfile = directory / "args_bench_snapshot.flags";
+  std::string snapshot_path = directory / "args_bench.snapshot";
+  std::string arg_list;
+  for (size_t i = 0; i < kFlags; ++i) {
+    arg_list += MixedFlags::arg(i) + "\n";
+  }
+  std::ofstream(flagfile) << arg_list;
+  write_snapshot(schema, flagfile, snapshot_path);
+  size_t tokens = count_tokens(arg_list);
+
+  runner.run("startup/3000/parse_flagfile", tokens, arg_list.size(), [&] {
+    FlagValues values = schema.makeValues();
+    Flagfiles files;
+    return parse_flagfile(SchemaRegistry<FlagValues>{schema, values},
+                          flagfile, files) &&
+           values.getInt32(0) == 37;
+  });
+  runner.run("startup/3000/load_snapshot", tokens, arg_list.size(), [&] {
+    FlagSnapshot snapshot;
+    return snapshot.load(schema, snapshot_path, flagfile) &&
+           snapshot.getInt32(0) == 37;
+  });
+  std::filesystem::remove(flagfile);
+  std::filesystem::remove(snapshot_path);
+}
+
+// Parses a long line where nine in ten flags are numeric, converting each
+// value as it is found and in two phases.
+void bench_two_phase(BenchmarkRunner& runner) {
+  FlagSchema schema;
+  std::string arg_list;
+  for (size_t i = 0; i < 300; ++i) {
+    std::string name = MixedFlags::name(i);
+    if (i % 10 == 0) {
+      schema.addString(name);
+      arg_list += "-" + name + " /hola/mundo ";
+    } else {
+      schema.addInt32(name);
+      arg_list += "-" + name + " " +
+                  std::to_string(static_cast<int>(i) * 7919 - 1000000) + " ";
+    }
+  }
+  FlagValues values = schema.makeValues();
+  PendingValues pending;
+  size_t tokens = count_tokens(arg_list);
+
+  runner.run("numeric_line/one_phase", tokens, arg_list.size(), [&] {
+    schema.reset(values);
+    return parse_arg_list(schema, arg_list, values);
+  });
+  runner.run("numeric_line/two_phase", tokens, arg_list.size(), [&] {
+    schema.reset(values);
+    return parse_two_phase(schema, arg_list, values, pending);
+  });
+}
+
+// Parses a line setting 500 flags of which only five are read, converting
+// every value up front and only those read.
+void bench_lazy(BenchmarkRunner& runner) {
+  FlagSchema schema;
+  std::string arg_list;
+  for (size_t i = 0; i < 500; ++i) {
+    std::string name = MixedFlags::name(i);
+    if (i % 2 == 0) {
+      schema.addString(name);
+      arg_list += "-" + name + " /srv/jobs/" + std::to_string(i) + "/config ";
+    } else {
+      schema.addInt32(name);
+      arg_list += "-" + name + " " + std::to_string(i * 7919) + " ";
+    }
+  }
+  size_t tokens = count_tokens(arg_list);
+  FlagValues values = schema.makeValues();
+
+  runner.run("read_few/eager", tokens, arg_list.size(), [&] {
+    schema.reset(values);
+    parse_arg_list(schema, arg_list, values);
+    int32_t sum = 0;
+    for (size_t i = 0; i < 5; ++i) {
+      sum += values.getInt32(i * 37);
+    }
+    return sum;
+  });
+  LazyFlagValues lazy(schema);
+  runner.run("read_few/lazy", tokens, arg_list.size(), [&] {
+    lazy.reset(schema);
+    parse_arg_list(schema, arg_list, lazy);
+    int32_t sum = 0;
+    for (size_t i = 0; i < 5; ++i) {
+      sum += lazy.getInt32(i * 37).value_or(0);
+    }
+    return sum;
+  });
+}
+
+// Validates a large batch of lines with 1, 2, 4, ... threads up to the
+// hardware concurrency.
+void bench_batch(BenchmarkRunner& runner) {
+  FlagSchema schema;
+  for (size_t i = 0; i < 30; ++i) {
+    switch (i % 3) {
+      case 0:
+        schema.addBool(MixedFlags::name(i));
+        break;
+      case 1:
+        schema.addInt32(MixedFlags::name(i));
+        break;
+      case 2:
+        schema.addString(MixedFlags::name(i));
+        break;
+    }
+  }
+  std::vector<std::string> storage;
+  size_t tokens = 0;
+  size_t bytes = 0;
+  for (size_t line = 0; line < 100000; ++line) {
+    std::string arg_list;
+    for (size_t i = 0; i < 6; ++i) {
+      arg_list += MixedFlags::arg((line * 7 + i) % 30);
+    }
+    tokens += count_tokens(arg_list);
+    bytes += arg_list.size();
+    storage.push_back(std::move(arg_list));
+  }
+  std::vector<std::string_view> lines(storage.begin(), storage.end());
+  std::vector<uint8_t> results(lines.size());
+
+  unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+    ParsePool pool(threads);
+    runner.run("batch/threads/" + std::to_string(threads), tokens, bytes, [&] {
+      pool.parse(schema, lines, results);
+      return results[0];
+    });
+  }
+}
+
+// Cost of reading a hot atomic flag while another thread keeps re-parsing,
+// either a flag on another cache line, the flag itself, or an atomic packed on
+// the same line as the hot one.
+void bench_atomic_flags(BenchmarkRunner& runner) {
+  const int kReads = 64;
+  AtomicInt32Flag rate;
+  AtomicInt32Flag port;
+  FlagRegistry registry;
+  registry["r"] = &rate;
+  registry["p"] = &port;
+  struct {
+    std::atomic<int32_t> rate{0};
+    std::atomic<int32_t> port{0};
+  } packed;
+  auto read_rate = [&] {
+    int32_t sum = 0;
+    for (int i = 0; i < kReads; ++i) {
+      sum += rate.getValue();
+    }
+    return sum;
+  };
+  auto read_packed = [&] {
+    int32_t sum = 0;
+    for (int i = 0; i < kReads; ++i) {
+      sum += packed.rate.load(std::memory_order_relaxed);
+    }
+    return sum;
+  };
+
+  auto with_writer = [&](std::string name, auto write, auto read) {
+    std::atomic<bool> stop{false};
+    std::thread writer([&] {
+      for (int32_t i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+        write(i & 0xffff);
+      }
+    });
+    runner.run(std::move(name), 0, 0, read);
+    stop = true;
+    writer.join();
+  };
+
+  runner.run("atomic_flags/read/no_writer", 0, 0, read_rate);
+  with_writer(
+      "atomic_flags/read/writer_other_flag",
+      [&](int32_t i) { parse_arg_list(registry, "-p " + std::to_string(i)); },
+      read_rate);
+  with_writer(
+      "atomic_flags/read/writer_same_flag",
+      [&](int32_t i) { parse_arg_list(registry, "-r " + std::to_string(i)); },
+      read_rate);
+  with_writer(
+      "atomic_flags/read/writer_same_line",
+      [&](int32_t i) { packed.port.store(i, std::memory_order_release); },
+      read_packed);
+}
+
+// Parses a long line of mixed flag kinds through heap-allocated flags called
+// virtually, and through the same flags held by value and visited.
+void bench_dispatch(BenchmarkRunner& runner) {
+  const size_t kFlags = 300;
+  MixedFlags flags(kFlags);
+  FlatFlagRegistry virtual_registry;
+  VariantFlags variant_flags;
+  VariantFlagRegistry variant_registry{variant_flags};
+  std::string arg_list;
+  for (size_t i = 0; i < kFlags; ++i) {
+    virtual_registry.add(MixedFlags::name(i), flags.flags[i].get());
+    switch (i % 3) {
+      case 0:
+        variant_flags.add(MixedFlags::name(i), BoolFlag());
+        break;
+      case 1:
+        variant_flags.add(MixedFlags::name(i), Int32Flag());
+        break;
+      case 2:
+        variant_flags.add(MixedFlags::name(i), StringFlag());
+        break;
+    }
+    arg_list += MixedFlags::arg(i);
+  }
+  size_t tokens = count_tokens(arg_list);
+
+  runner.run("dispatch/virtual", tokens, arg_list.size(),
+             [&] { return parse_arg_list(virtual_registry, arg_list); });
+  runner.run("dispatch/variant", tokens, arg_list.size(),
+             [&] { return parse_arg_list(variant_registry, arg_list); });
+}
+
+// Parses a line that sets each of N boolean flags once, against each registry
+// backend, and reports the heap bytes each registry takes.
+template <size_t N>
+void bench_registry(BenchmarkRunner& runner) {
+  std::vector<std::string> storage;
+  for (size_t i = 0; i < N; ++i) {
+    storage.push_back("flag_" + std::to_string(i));
+  }
+  auto names = std::make_unique<std::array<std::string_view, N>>();
+  for (size_t i = 0; i < N; ++i) {
+    (*names)[i] = storage[i];
+  }
+  std::vector<BoolFlag> flags(N);
+
+  size_t heap = live_bytes.load();
+  FlagRegistry dynamic_registry;
+  for (size_t i = 0; i < N; ++i) {
+    dynamic_registry[storage[i]] = &flags[i];
+  }
+  size_t unordered_bytes = live_bytes.load() - heap;
+
+  heap = live_bytes.load();
+  auto hash = std::make_unique<PerfectHash<N>>(*names);
+  auto static_registry = std::make_unique<StaticFlagRegistry<N>>(
+      StaticFlagRegistry<N>{*hash, {}});
+  for (size_t i = 0; i < N; ++i) {
+    static_registry->flags[i] = &flags[i];
+  }
+  size_t perfect_bytes = live_bytes.load() - heap;
+
+  heap = live_bytes.load();
+  FlatFlagRegistry flat_registry;
+  for (size_t i = 0; i < N; ++i) {
+    flat_registry.add(storage[i], &flags[i]);
+  }
+  size_t flat_bytes = live_bytes.load() - heap;
+
+  std::string arg_list;
+  for (size_t i = 0; i < N; ++i) {
+    arg_list += "-" + storage[(i * 7919) % N] + " ";
+  }
+  std::string prefix = "registry/" + std::to_string(N);
+
+  runner
+      .run(prefix + "/unordered_map", N, arg_list.size(),
+           [&] { return parse_arg_list(dynamic_registry, arg_list); })
+      .counters.push_back({"registry_bytes", unordered_bytes});
+  runner
+      .run(prefix + "/perfect_hash", N, arg_list.size(),
+           [&] { return parse_arg_list(*static_registry, arg_list); })
+      .counters.push_back({"registry_bytes", perfect_bytes});
+  runner
+      .run(prefix + "/flat", N, arg_list.size(),
+           [&] { return parse_arg_list(flat_registry, arg_list); })
+      .counters.push_back({"registry_bytes", flat_bytes});
+}
+
+#ifdef ARGS_GENERATED_PARSER
+#include ARGS_GENERATED_PARSER
+
+// Needs a GeneratedFlags parser generated from "args schema <count>":
+//
+//   ./args schema 5000 > mixed.schema
+//   ./args generate GeneratedFlags mixed.schema > generated_flags.inc
+//   g++ -std=c++20 -O2 -DARGS_GENERATED_PARSER='"generated_flags.inc"' args.cpp
+void bench_generated(BenchmarkRunner& runner) {
+  const size_t kFlags = GeneratedFlagsIndex::kFlags;
+  auto flags = std::make_unique<GeneratedFlags>();
+  GeneratedFlagsRegistry registry{*flags};
+  MixedFlags mixed(kFlags);
+  std::string arg_list;
+  for (size_t i = 0; i < kFlags; ++i) {
+    arg_list += MixedFlags::arg((i * 7919) % kFlags);
+  }
+  bool success = parse_flags(arg_list, *flags);
+  assert(success);
+  success = parse_arg_list(registry, arg_list);
+  assert(success);
+  success = parse_arg_list(mixed.registry, arg_list);
+  assert(success);
+  size_t tokens = count_tokens(arg_list);
+  std::string prefix = "generated/" + std::to_string(kFlags);
+
+  runner.run(prefix + "/parse_flags", tokens, arg_list.size(),
+             [&] { return parse_flags(arg_list, *flags); });
+  runner.run(prefix + "/parse_arg_list", tokens, arg_list.size(),
+             [&] { return parse_arg_list(registry, arg_list); });
+  runner.run(prefix + "/unordered_map", tokens, arg_list.size(),
+             [&] { return parse_arg_list(mixed.registry, arg_list); });
+}
+#endif
+
+int main(int argc, char** argv) {
+  // "args bench" prints benchmark results; "args bench --json" prints them as
+  // JSON for comparing runs.
+  if (argc > 1 && std::string_view(argv[1]) == "bench") {
+    BenchmarkRunner runner;
+    bench_tokenizer(runner);
+    bench_structural_index(runner);
+    bench_flagfile(runner);
+    bench_int32(runner);
+    bench_scenarios(runner);
+    bench_dispatch(runner);
+    bench_batch(runner);
+    bench_atomic_flags(runner);
+    bench_two_phase(runner);
+    bench_lazy(runner);
+    bench_snapshot(runner);
+    bench_registry<3>(runner);
+    bench_registry<30>(runner);
+    bench_registry<300>(runner);
+    bench_registry<3000>(runner);
+#ifdef ARGS_GENERATED_PARSER
+    bench_generated(runner);
+#endif
+    if (argc > 2 && std::string_view(argv[2]) == "--json") {
+      runner.printJson(std::cout);
+    } else {
+      runner.print(std::cout);
+    }
+    return 0;
+  }
+  // "args generate <type name> [schema file]" prints a parser generated for
+  // the schema, read from standard input if no file is given.
+  if (argc > 2 && std::string_view(argv[1]) == "generate") {
+    std::ostringstream schema;
+    if (argc > 3) {
+      std::ifstream file(argv[3]);
+      if (!file) {
+        std::cerr << "cannot open " << argv[3] << std::endl;
+        return 1;
+      }
+      schema << file.rdbuf();
+    } else {
+      schema << std::cin.rdbuf();
+    }
+    return generate_parser(schema.str(), argv[2], std::cout, std::cerr) ? 0
+                                                                         : 1;
+  }
+  // "args schema <count>" prints the schema of the first `count` flags of
+  // MixedFlags, for bench_generated.
+  if (argc > 2 && std::string_view(argv[1]) == "schema") {
+    size_t count = std::strtoul(argv[2], nullptr, 10);
+    for (size_t i = 0; i < count; ++i) {
+      const char* kinds[] = {"bool", "int32", "string"};
+      std::cout << MixedFlags::name(i) << " " << kinds[i % 3] << "\n";
+    }
+    return 0;
+  }
+
   test_happy();
   test_not_in_arg_list();
   test_not_in_scheme();
@@ -189,6 +5177,51 @@ int main() {
   test_early_exit();
   test_bad_int();
   test_duplicate();
+  test_tokenizer_matches_stream();
+  test_argv();
+  test_argv_span_has_no_program_name();
+  test_argv_empty();
+  test_static_registry();
+  test_flag_set();
+  test_preset_matches_runtime_parse();
+  test_perfect_hash_large();
+  test_flat_registry();
+  test_flat_registry_grows_and_replaces();
+  test_parse_int32();
+  test_parse_int32_matches_from_chars();
+  test_overflow();
+  test_variant_registry();
+  test_steady_state_parse_does_not_allocate();
+  test_schema();
+  test_schema_duplicate_name();
+  test_schema_reset_does_not_allocate();
+  test_lazy_values();
+  test_flagfile();
+  test_flagfile_cycle();
+  test_stream_parser();
+  test_stream_parser_matches_parse_arg_list();
+  test_stream_parser_memory_stays_flat();
+  test_stream_parser_errors();
+  test_parse_async();
+  test_parse_async_spurious_wakeup();
+  test_snapshot();
+  test_shared_segment();
+  test_build_perfect_hash();
+  test_generate_parser();
+  test_atomic_flags();
+  test_config_store();
+  test_config_store_stress();
+  test_string_view_flag();
+  test_values_borrow_strings();
+  test_string_arena();
+  test_values_copy_owns_its_strings();
+  test_parse_batch();
+  test_whitespace_mask();
+  test_structural_index_matches_tokenizer();
+  test_structural_index_rejects_long_input();
+  test_parse_indexed_matches_parse_arg_list();
+  test_two_phase();
+  test_two_phase_matches_parse_arg_list();
 
   std::cout << ":)" << std::endl;
 }